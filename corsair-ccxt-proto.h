@@ -0,0 +1,394 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * corsair-ccxt-proto.h - Protocol of the Corsair Commander Core XT, shared by
+ * the driver and debug-tool
+ * Copyright (C) 2025 Max Rumpf <kernel@maxr1998.de>
+ *
+ * Commands are encoded into and responses decoded from plain buffers, sending
+ * them is left to a transport. That way the same code runs on top of
+ * hid_hw_output_report() in the kernel and on top of hidapi or a simulated
+ * device in userspace. Userspace has to include polyfills.h first.
+ */
+
+#ifndef _CORSAIR_CCXT_PROTO_H
+#define _CORSAIR_CCXT_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#endif
+
+#define OUT_BUFFER_SIZE 385
+#define IN_BUFFER_SIZE 384
+
+#define CMD_HEADER_SIZE 2
+/* index of the echoed command in a response */
+#define RESPONSE_CMD_INDEX 1
+#define WRITE_DATA_HEADER_SIZE 4
+
+#define FW_VERSION_INDEX 3
+
+#define FAN_CNT_INDEX 5
+#define FAN_DATA_OFFSET 6
+
+#define TEMP_CNT_INDEX 5
+#define TEMP_DATA_OFFSET 6
+#define TEMP_DATA_SIZE 3
+
+#define FAN_PWM_DATA_SIZE 4
+
+#define MODE_INDEX 3
+#define MODE_HARDWARE 0x01
+#define MODE_SOFTWARE 0x02
+
+#define FAN_STATE_OK 0x07
+#define TEMP_STATE_OK 0x00
+
+/* no endpoint is open on the device */
+#define ENDPOINT_NONE -1
+/* endpoint state is unknown, e.g. after probe or a failed request */
+#define ENDPOINT_UNKNOWN -2
+
+/**
+ * Returns the firmware version as four bytes (patch version uses two bytes)
+ */
+static const u8 cmd_get_firmware[] = { 0x02, 0x13 };
+static const u8 cmd_hardware_mode[] = { 0x01, 0x03, 0x00, 0x01 };
+static const u8 cmd_software_mode[] = { 0x01, 0x03, 0x00, 0x02 };
+/**
+ * Reads the property set by cmd_hardware_mode / cmd_software_mode, the value is returned in the
+ * same position as the firmware version.
+ */
+static const u8 cmd_get_mode[] = { 0x02, 0x03, 0x00 };
+static const u8 cmd_open_endpoint[] = { 0x0d, 0x01 };
+static const u8 cmd_close_endpoint[] = { 0x05, 0x01, 0x01 };
+static const u8 cmd_write[] = { 0x06, 0x01 };
+static const u8 cmd_read[] = { 0x08, 0x01 };
+
+/**
+ * Endpoint to query the fan speed of all connected fans.
+ */
+static const u8 endpoint_fan_state = 0x17;
+
+/**
+ * Endpoint to set the fan PWM of one or multiple fans by id.
+ */
+static const u8 endpoint_fan_pwm = 0x18;
+
+/**
+ * Endpoint to query the number of total supported fans and the connection state for each.
+ */
+static const u8 endpoint_get_fans = 0x1a;
+
+/**
+ * Endpoint to query the number of total supported temperature sensors
+ * and the temperature reported by each connected sensor.
+ */
+static const u8 endpoint_get_temperatures = 0x21;
+
+static const u8 data_type_set_speed[] = { 0x07, 0x00 };
+
+#define ccxt_proto_cmd_safe(out, cmd) \
+	({ ccxt_proto_cmd(out, cmd, ARRAY_SIZE(cmd)); })
+
+#define ccxt_proto_endpoint_cmd_safe(out, cmd, endpoint) \
+	({ ccxt_proto_endpoint_cmd(out, cmd, ARRAY_SIZE(cmd), endpoint); })
+
+/* prepare out with command and return used size */
+static inline int ccxt_proto_cmd(u8 *out, const u8 *command,
+				 size_t command_len)
+{
+	memset(out, 0x00, OUT_BUFFER_SIZE);
+	out[0] = 0x00;
+	out[1] = 0x08;
+	memcpy(out + CMD_HEADER_SIZE, command, command_len);
+
+	return CMD_HEADER_SIZE + command_len;
+}
+
+/* prepare out with command and single-valued endpoint and return used size */
+static inline int ccxt_proto_endpoint_cmd(u8 *out, const u8 *command,
+					  size_t command_len, u8 endpoint)
+{
+	int ret = ccxt_proto_cmd(out, command, command_len);
+
+	out[ret] = endpoint;
+	return ret + 1;
+}
+
+/* prepare out with a write of data of the given type and return used size */
+static inline int ccxt_proto_write_cmd(u8 *out, const u8 *data_type,
+				       size_t data_type_size, const u8 *data,
+				       size_t data_size)
+{
+	u8 *writer_header_dst, *data_type_dst, *data_dst;
+	int ret = ccxt_proto_cmd_safe(out, cmd_write);
+
+	/* compute header offsets */
+	writer_header_dst = out + ret;
+	data_type_dst = writer_header_dst + WRITE_DATA_HEADER_SIZE;
+	data_dst = data_type_dst + data_type_size;
+
+	writer_header_dst[0] = data_type_size + data_size;
+	memcpy(data_type_dst, data_type, data_type_size);
+	memcpy(data_dst, data, data_size);
+
+	return data_dst + data_size - out;
+}
+
+/*
+ * encode the duty cycles (0-100) of the given channels for endpoint_fan_pwm
+ * into speed_cmd, which needs room for 1 + num_fans * FAN_PWM_DATA_SIZE
+ * bytes. Returns the used size, speed_cmd[0] is the number of channels.
+ */
+static inline size_t ccxt_proto_encode_pwm(u8 *speed_cmd, const u8 *duty,
+					   unsigned long channels,
+					   int num_fans)
+{
+	/* {count, {id, mode, val, 0x00} per channel} */
+	u8 *entry = speed_cmd + 1;
+	int channel;
+
+	speed_cmd[0] = 0;
+	for (channel = 0; channel < num_fans; channel++) {
+		if (!(channels & (1UL << channel)))
+			continue;
+
+		entry[0] = channel;
+		entry[1] = 0;
+		entry[2] = duty[channel];
+		entry[3] = 0x00;
+		entry += FAN_PWM_DATA_SIZE;
+		speed_cmd[0]++;
+	}
+
+	return entry - speed_cmd;
+}
+
+/* converts the status byte of a response to errno, -EIO if unknown */
+static inline int ccxt_proto_errno(u8 status)
+{
+	switch (status) {
+	case 0x00: /* success */
+		return 0;
+	case 0x01: /* called invalid command */
+		return -EOPNOTSUPP;
+	case 0x10: /* called GET_VOLT / GET_TMP with invalid arguments */
+		return -EINVAL;
+	case 0x11: /* requested temps of disconnected sensors */
+	case 0x12: /* requested pwm of not pwm-controlled channels */
+		return -ENODATA;
+	default:
+		return -EIO;
+	}
+}
+
+static inline void ccxt_proto_fw_version(const u8 *in, u8 *major, u8 *minor,
+					 u16 *patch)
+{
+	*major = in[FW_VERSION_INDEX];
+	*minor = in[FW_VERSION_INDEX + 1];
+	*patch = (u16)in[FW_VERSION_INDEX + 2] |
+		 (u16)in[FW_VERSION_INDEX + 3] << 8;
+}
+
+/* decode the response to cmd_get_mode */
+static inline int ccxt_proto_mode(const u8 *in, bool *hardware)
+{
+	switch (in[MODE_INDEX]) {
+	case MODE_HARDWARE:
+		*hardware = true;
+		return 0;
+	case MODE_SOFTWARE:
+		*hardware = false;
+		return 0;
+	default:
+		return -EBADMSG;
+	}
+}
+
+/* the theoretical number of fans in a response of the fan endpoints */
+static inline int ccxt_proto_fan_count(const u8 *in)
+{
+	return in[FAN_CNT_INDEX];
+}
+
+/* the theoretical number of sensors in a response of endpoint_get_temperatures */
+static inline int ccxt_proto_temp_count(const u8 *in)
+{
+	return in[TEMP_CNT_INDEX];
+}
+
+/* decode endpoint_get_fans */
+static inline bool ccxt_proto_fan_connected(const u8 *in, int channel)
+{
+	return in[FAN_DATA_OFFSET + channel] == FAN_STATE_OK;
+}
+
+/* decode endpoint_fan_state, two bytes per value */
+static inline int ccxt_proto_rpm(const u8 *in, int channel)
+{
+	int data_index = FAN_DATA_OFFSET + channel * 2;
+
+	return (s16)((u16)in[data_index] | (u16)in[data_index + 1] << 8);
+}
+
+/* decode endpoint_fan_pwm to 0-255, -EBADMSG if the channel id doesn't match */
+static inline int ccxt_proto_pwm(const u8 *in, int channel)
+{
+	int data_index = FAN_DATA_OFFSET + channel * FAN_PWM_DATA_SIZE;
+
+	if (in[data_index] != channel)
+		return -EBADMSG;
+
+	return DIV_ROUND_CLOSEST(in[data_index + 2] * 255, 100);
+}
+
+/*
+ * decode endpoint_get_temperatures to millidegree Celsius, -ENODATA if the
+ * sensor is disconnected. Sensors report {state, value (two bytes, 0.1
+ * degree Celsius)}.
+ */
+static inline int ccxt_proto_temp(const u8 *in, int channel, long *val)
+{
+	int data_index = TEMP_DATA_OFFSET + channel * TEMP_DATA_SIZE;
+
+	if (in[data_index] != TEMP_STATE_OK)
+		return -ENODATA;
+
+	*val = (s16)((u16)in[data_index + 1] | (u16)in[data_index + 2] << 8) *
+	       100;
+	return 0;
+}
+
+/**
+ * struct ccxt_proto_transport - how a session reaches the device
+ * @queue: send the command in the session's out buffer. The response may be
+ *	collected by a later call, errors may show up there instead.
+ * @send: send the command in the session's out buffer and wait for its
+ *	response and those of queued commands, returns the first error. The
+ *	response is left in the transport's input buffer.
+ */
+struct ccxt_proto_transport {
+	int (*queue)(void *priv);
+	int (*send)(void *priv);
+};
+
+/**
+ * struct ccxt_proto_session - endpoint session on one device
+ * @ops: transport used for all commands
+ * @priv: passed to @ops
+ * @out: OUT_BUFFER_SIZE bytes the commands are prepared in
+ * @open_endpoint: endpoint currently open on the device or ENDPOINT_*
+ *
+ * Callers serialize all access to a session.
+ */
+struct ccxt_proto_session {
+	const struct ccxt_proto_transport *ops;
+	void *priv;
+	u8 *out;
+	int open_endpoint;
+};
+
+static inline void ccxt_proto_session_init(struct ccxt_proto_session *s,
+					   const struct ccxt_proto_transport *ops,
+					   void *priv, u8 *out)
+{
+	s->ops = ops;
+	s->priv = priv;
+	s->out = out;
+	s->open_endpoint = ENDPOINT_UNKNOWN;
+}
+
+/* close the endpoint session if there is one */
+static inline int ccxt_proto_close(struct ccxt_proto_session *s)
+{
+	int ret;
+
+	if (s->open_endpoint < 0)
+		return 0;
+
+	ccxt_proto_endpoint_cmd_safe(s->out, cmd_close_endpoint,
+				     s->open_endpoint);
+	ret = s->ops->queue(s->priv);
+	s->open_endpoint = ret ? ENDPOINT_UNKNOWN : ENDPOINT_NONE;
+
+	return ret;
+}
+
+/*
+ * make sure the given endpoint is open on the device. The endpoint stays
+ * open for subsequent requests to the same endpoint. The session commands
+ * may still be in flight, see ccxt_proto_transport.queue.
+ */
+static inline int ccxt_proto_open(struct ccxt_proto_session *s, u8 endpoint)
+{
+	int ret;
+
+	if (s->open_endpoint == endpoint)
+		return 0;
+
+	if (s->open_endpoint == ENDPOINT_UNKNOWN) {
+		/* the endpoint might still be open from an earlier session */
+		ccxt_proto_endpoint_cmd_safe(s->out, cmd_close_endpoint,
+					     endpoint);
+		ret = s->ops->queue(s->priv);
+		if (ret)
+			return ret;
+	} else {
+		ret = ccxt_proto_close(s);
+		if (ret)
+			return ret;
+	}
+
+	ccxt_proto_endpoint_cmd_safe(s->out, cmd_open_endpoint, endpoint);
+	ret = s->ops->queue(s->priv);
+	s->open_endpoint = ret ? ENDPOINT_UNKNOWN : endpoint;
+
+	return ret;
+}
+
+/* read the given endpoint, the response is left in the transport's buffer */
+static inline int ccxt_proto_read(struct ccxt_proto_session *s, u8 endpoint)
+{
+	int ret;
+
+	ret = ccxt_proto_open(s, endpoint);
+	if (ret)
+		return ret;
+
+	ccxt_proto_endpoint_cmd_safe(s->out, cmd_read, endpoint);
+	ret = s->ops->send(s->priv);
+	if (ret)
+		s->open_endpoint = ENDPOINT_UNKNOWN;
+
+	return ret;
+}
+
+/* write data of the given type to the endpoint */
+static inline int ccxt_proto_write(struct ccxt_proto_session *s, u8 endpoint,
+				   const u8 *data_type, size_t data_type_size,
+				   const u8 *data, size_t data_size)
+{
+	int ret;
+
+	ret = ccxt_proto_open(s, endpoint);
+	if (ret)
+		return ret;
+
+	ccxt_proto_write_cmd(s->out, data_type, data_type_size, data,
+			     data_size);
+	ret = s->ops->send(s->priv);
+	if (ret)
+		s->open_endpoint = ENDPOINT_UNKNOWN;
+
+	return ret;
+}
+
+#endif /* _CORSAIR_CCXT_PROTO_H */
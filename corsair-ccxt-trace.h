@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * corsair-ccxt-trace.h - Tracepoints for the Corsair Commander Core XT driver
+ * Copyright (C) 2025 Max Rumpf <kernel@maxr1998.de>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM corsair_ccxt
+
+#if !defined(_CORSAIR_CCXT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CORSAIR_CCXT_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+
+#define CCXT_TRACE_DEV_LEN 32
+#define CCXT_TRACE_CMD_LEN 4
+
+/* a command is sent to the device, cmd points to the command without header */
+TRACE_EVENT(ccxt_usb_tx,
+	TP_PROTO(struct hid_device *hdev, const u8 *cmd),
+	TP_ARGS(hdev, cmd),
+	TP_STRUCT__entry(
+		__array(char, dev, CCXT_TRACE_DEV_LEN)
+		__array(u8, cmd, CCXT_TRACE_CMD_LEN)
+	),
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CCXT_TRACE_DEV_LEN);
+		memcpy(__entry->cmd, cmd, CCXT_TRACE_CMD_LEN);
+	),
+	TP_printk("%s cmd=%*ph", __entry->dev, CCXT_TRACE_CMD_LEN,
+		__entry->cmd)
+);
+
+/* the response to a command arrived or the request failed */
+TRACE_EVENT(ccxt_usb_rx,
+	TP_PROTO(struct hid_device *hdev, u8 cmd, int ret, int size,
+		s64 latency_ns),
+	TP_ARGS(hdev, cmd, ret, size, latency_ns),
+	TP_STRUCT__entry(
+		__array(char, dev, CCXT_TRACE_DEV_LEN)
+		__field(u8, cmd)
+		__field(int, ret)
+		__field(int, size)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CCXT_TRACE_DEV_LEN);
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->size = size;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("%s cmd=%02x ret=%d size=%d latency=%lldns", __entry->dev,
+		__entry->cmd, __entry->ret, __entry->size, __entry->latency_ns)
+);
+
+/* a sensor value was read, either from the snapshot or from the device */
+TRACE_EVENT(ccxt_read,
+	TP_PROTO(struct hid_device *hdev, u8 endpoint, int channel, long val,
+		int ret, bool cached),
+	TP_ARGS(hdev, endpoint, channel, val, ret, cached),
+	TP_STRUCT__entry(
+		__array(char, dev, CCXT_TRACE_DEV_LEN)
+		__field(u8, endpoint)
+		__field(int, channel)
+		__field(long, val)
+		__field(int, ret)
+		__field(bool, cached)
+	),
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CCXT_TRACE_DEV_LEN);
+		__entry->endpoint = endpoint;
+		__entry->channel = channel;
+		__entry->val = val;
+		__entry->ret = ret;
+		__entry->cached = cached;
+	),
+	TP_printk("%s endpoint=%02x channel=%d val=%ld ret=%d cached=%d",
+		__entry->dev, __entry->endpoint, __entry->channel, __entry->val,
+		__entry->ret, __entry->cached)
+);
+
+/* a value was written to the device */
+TRACE_EVENT(ccxt_write,
+	TP_PROTO(struct hid_device *hdev, u8 endpoint, int channel, long val,
+		int ret),
+	TP_ARGS(hdev, endpoint, channel, val, ret),
+	TP_STRUCT__entry(
+		__array(char, dev, CCXT_TRACE_DEV_LEN)
+		__field(u8, endpoint)
+		__field(int, channel)
+		__field(long, val)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CCXT_TRACE_DEV_LEN);
+		__entry->endpoint = endpoint;
+		__entry->channel = channel;
+		__entry->val = val;
+		__entry->ret = ret;
+	),
+	TP_printk("%s endpoint=%02x channel=%d val=%ld ret=%d", __entry->dev,
+		__entry->endpoint, __entry->channel, __entry->val,
+		__entry->ret)
+);
+
+#endif /* _CORSAIR_CCXT_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE corsair-ccxt-trace
+#include <trace/define_trace.h>
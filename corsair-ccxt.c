@@ -5,22 +5,46 @@
  * Copyright (C) 2025 Max Rumpf <kernel@maxr1998.de>
  *
  * This driver uses hid reports to communicate with the device to allow hidraw userspace drivers
- * still being used. The device does not use report ids. When using hidraw and this driver
- * simultaneously, reports could be switched.
+ * still being used. The device does not use report ids, but echoes the command in every response.
+ * Responses to other commands sent by hidraw users are recognized by that and ignored.
+ * Responses to the same command can't be told apart, e.g. a hidraw read of another endpoint
+ * while the driver waits for its own read, so such users should not run alongside the driver.
  */
 
 #include <linux/bitops.h>
+#include <linux/cache.h>
 #include <linux/completion.h>
 #include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/jiffies.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/sysfs.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "corsair-ccxt.h"
+#include "corsair-ccxt-proto.h"
+
+#define CREATE_TRACE_POINTS
+#include "corsair-ccxt-trace.h"
 
 // ReSharper disable CppJoinDeclarationAndAssignment CppLocalVariableMayBeConst CppParameterMayBeConst CppParameterMayBeConstPtrOrRef
 
@@ -29,8 +53,12 @@
 
 /*
 TODO:
- - add function to query current mode (hardware or software control) and expose it somehow.
- - check whether we can set fan target (RPM) as an alternative
+ - find the endpoint for uploading fan curves the device runs in hardware mode.
+ - find out whether the device reports the voltages of its SATA power input.
+   They change slowly and should get their own snapshot section with a longer
+   cache time than fans and temperatures.
+ - check whether the device can follow fan targets (RPM) on its own instead
+   of the driver doing it
  - automatically switch to software mode when writing pwm or rpm values (on errors only)?
 */
 
@@ -40,138 +68,549 @@ TODO:
 #define NUM_FANS 6
 #define NUM_TEMP_SENSORS 2
 
+/* number of points of a fan curve, the sysfs attributes below assume 4 */
+#define CURVE_POINTS 4
+/* default temperature drop in millidegree Celsius before a curve follows it */
+#define CURVE_TEMP_HYST 2000
+
 #define REQ_TIMEOUT 300
-#define OUT_BUFFER_SIZE 385
-#define IN_BUFFER_SIZE 384
+#define REQ_TIMEOUT_MIN 20
+/* wait before the first retry of a failed endpoint access, doubled for each further one */
+#define RETRY_BACKOFF_MS 10
+/* retries run under ccxt->mutex, bound how long they block other requests */
+#define RETRIES_MAX 5U
+#define RETRY_BACKOFF_MAX_SHIFT 3U
+/* minimum time between rescans hinted by snapshots, unless polling slower */
+#define HOTPLUG_RESCAN_DELAY_MS 1000
 #define LABEL_LENGTH 11
 
-#define CMD_HEADER_SIZE 2
-#define WRITE_DATA_HEADER_SIZE 4
+/*
+ * Most commands in flight when pipelining (close, open and read or write of
+ * an endpoint) and the first firmware assumed to queue them.
+ */
+#define PIPELINE_MAX_DEPTH 3U
+#define PIPELINE_MIN_FW_MAJOR 2
 
-#define FAN_CNT_INDEX 5
-#define FAN_DATA_OFFSET 6
+/* values of pwm*_enable */
+#define FAN_MODE_MANUAL 1
+#define FAN_MODE_CURVE 2
+#define FAN_MODE_TARGET 3
 
-#define TEMP_CNT_INDEX 5
-#define TEMP_DATA_OFFSET 6
+/*
+ * Gains of the rpm target controller, in 1/1000 pwm per rpm of error and
+ * 1/1000 pwm per rpm of error and second.
+ */
+#define TARGET_KP 125
+#define TARGET_KI 60
+
+static unsigned int cache_time_ms = 1000;
+module_param(cache_time_ms, uint, 0644);
+MODULE_PARM_DESC(cache_time_ms,
+		"Default time in ms a fan state snapshot is served without a new device request (0 disables caching)");
+
+static unsigned int poll_interval_ms;
+module_param(poll_interval_ms, uint, 0644);
+MODULE_PARM_DESC(poll_interval_ms,
+		"Default interval in ms for refreshing all sensors in the background (0 disables polling)");
+
+static unsigned int timeout_min_ms = REQ_TIMEOUT_MIN;
+module_param(timeout_min_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_min_ms,
+		"Lower bound in ms of the request timeout derived from measured round trip times");
+
+static unsigned int timeout_max_ms = REQ_TIMEOUT;
+module_param(timeout_max_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_max_ms,
+		"Upper bound in ms of the request timeout, also used until round trip times are known");
+
+static unsigned int control_interval_ms = 1000;
+module_param(control_interval_ms, uint, 0644);
+MODULE_PARM_DESC(control_interval_ms,
+		"Interval in ms for evaluating fan curves and rpm targets of channels in automatic mode");
+
+static unsigned int pipeline_depth = 1;
+module_param(pipeline_depth, uint, 0644);
+MODULE_PARM_DESC(pipeline_depth,
+		"Number of commands of an endpoint access sent before waiting for responses (1 disables pipelining, max 3)");
+
+static unsigned int rescan_interval_ms;
+module_param(rescan_interval_ms, uint, 0644);
+MODULE_PARM_DESC(rescan_interval_ms,
+		"Interval in ms for re-detecting connected fans and sensors (0 only rescans on demand)");
+
+static unsigned int pwm_flush_delay_ms;
+module_param(pwm_flush_delay_ms, uint, 0644);
+MODULE_PARM_DESC(pwm_flush_delay_ms,
+		"Default time in ms pwm writes are collected before being sent in one request (0 writes immediately)");
+
+static unsigned int pwm_min_interval_ms;
+module_param(pwm_min_interval_ms, uint, 0644);
+MODULE_PARM_DESC(pwm_min_interval_ms,
+		"Default minimum time in ms between two writes of the pwm value of a fan (0 disables the limit)");
+
+static unsigned int retries = 2;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries,
+		"Number of retries of an endpoint access that timed out or got no valid response (at most 5)");
+
+static unsigned int breaker_threshold = 3;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold,
+		"Consecutive failed endpoint accesses after which requests are paused and stale values served (0 never pauses)");
+
+static unsigned int breaker_cooldown_ms = 5000;
+module_param(breaker_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(breaker_cooldown_ms,
+		"Time in ms requests are paused before a single access checks whether the device responds again");
+
+/* a command sent to the device, protected by wait_input_report_lock */
+struct ccxt_inflight {
+	u8 cmd; /* command the response must echo */
+	u8 status; /* status byte of the response */
+	int size; /* size of the response */
+	ktime_t tx;
+	ktime_t rx;
+};
 
-#define FAN_STATE_OK 0x07
+struct firmware_version {
+	u8 major;
+	u8 minor;
+	u16 patch;
+};
 
-#define prepare_cmd_safe(ccxt, cmd) \
-	({ prepare_cmd(ccxt, cmd, ARRAY_SIZE(cmd)); })
+/* parts of a snapshot, each backed by one endpoint */
+enum ccxt_snapshot_section {
+	SNAPSHOT_FAN_STATE, /* endpoint_fan_state */
+	SNAPSHOT_FAN_PWM, /* endpoint_fan_pwm */
+	SNAPSHOT_TEMPERATURES, /* endpoint_get_temperatures */
+	NUM_SNAPSHOT_SECTIONS
+};
 
-#define prepare_endpoint_cmd_safe(ccxt, cmd, endpoint) \
-	({ prepare_endpoint_cmd(ccxt, cmd, ARRAY_SIZE(cmd), endpoint); })
+#define SNAPSHOT_ALL (BIT(NUM_SNAPSHOT_SECTIONS) - 1)
 
-/**
- * Returns the firmware version as four bytes (patch version uses two bytes)
- */
-static const u8 cmd_get_firmware[] = { 0x02, 0x13 };
-static const u8 cmd_hardware_mode[] = { 0x01, 0x03, 0x00, 0x01 };
-static const u8 cmd_software_mode[] = { 0x01, 0x03, 0x00, 0x02 };
-static const u8 cmd_open_endpoint[] = { 0x0d, 0x01 };
-static const u8 cmd_close_endpoint[] = { 0x05, 0x01, 0x01 };
-static const u8 cmd_write[] = { 0x06, 0x01 };
-static const u8 cmd_read[] = { 0x08, 0x01 };
+/* alarm bitmaps of the snapshot, indexed by channel */
+enum ccxt_alarm {
+	ALARM_FAN_MIN, /* connected fan slower than fan*_min */
+	ALARM_FAN_FAULT, /* connected fan stands still while driven */
+	ALARM_TEMP_FAULT, /* sensor found at probe reported as disconnected */
+	NUM_ALARMS,
+};
 
-/**
- * Endpoint to query the fan speed of all connected fans.
+/*
+ * Decoded sensor values. Readers access the published snapshot under
+ * rcu_read_lock(), writers fill another buffer under ccxt->mutex, see
+ * snapshot_begin().
  */
-static const u8 endpoint_fan_state = 0x17;
+struct ccxt_snapshot {
+	u64 seq; /* incremented on every publish */
+	u64 timestamp_ns; /* CLOCK_MONOTONIC time of the publish */
+	unsigned long valid; /* bitmask of sections holding decoded values */
+	unsigned long stale; /* bitmask of sections keeping values from before a failed read */
+	int err[NUM_SNAPSHOT_SECTIONS]; /* result of the last read of each section */
+	unsigned long updated[NUM_SNAPSHOT_SECTIONS]; /* jiffies of the last read */
+	int num_fans;
+	long rpm[NUM_FANS];
+	long pwm[NUM_FANS]; /* 0-255 */
+	int num_temp_sensors;
+	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
+	long temp[NUM_TEMP_SENSORS]; /* millidegree Celsius */
+	unsigned long alarms[NUM_ALARMS];
+	struct rcu_head rcu; /* frees snapshots not in snapshot_buf */
+} ____cacheline_aligned_in_smp;
+
+/* commands accounted separately in the stats */
+enum ccxt_cmd_stat {
+	CMD_STAT_SET,
+	CMD_STAT_GET,
+	CMD_STAT_OPEN,
+	CMD_STAT_CLOSE,
+	CMD_STAT_READ,
+	CMD_STAT_WRITE,
+	CMD_STAT_OTHER,
+	NUM_CMD_STATS
+};
 
-/**
- * Endpoint to set the fan PWM of one or multiple fans by id.
- */
-static const u8 endpoint_fan_pwm = 0x18;
+/* endpoints accounted separately in the stats, per read_data()/write_data() call */
+enum ccxt_endpoint_stat {
+	ENDPOINT_STAT_FAN_STATE,
+	ENDPOINT_STAT_FAN_PWM,
+	ENDPOINT_STAT_GET_FANS,
+	ENDPOINT_STAT_GET_TEMPERATURES,
+	ENDPOINT_STAT_OTHER,
+	NUM_ENDPOINT_STATS
+};
 
-/**
- * Endpoint to query the number of total supported fans and the connection state for each.
+/* request results accounted in the stats */
+enum ccxt_result_stat {
+	RESULT_STAT_OK,
+	RESULT_STAT_TIMEOUT, /* -ETIMEDOUT */
+	RESULT_STAT_PROTO, /* -EPROTO, unexpected response size */
+	RESULT_STAT_UNSUPPORTED, /* -EOPNOTSUPP reported by the device */
+	RESULT_STAT_INVALID, /* -EINVAL reported by the device */
+	RESULT_STAT_NODATA, /* -ENODATA reported by the device */
+	RESULT_STAT_IO, /* -EIO, unknown device error */
+	RESULT_STAT_OTHER, /* e.g. failure to send the output report */
+	NUM_RESULT_STATS
+};
+
+/* log2 buckets of the latency in us, the last one collects everything above */
+#define NUM_LATENCY_BUCKETS 24
+
+struct ccxt_stats_entry {
+	u64 results[NUM_RESULT_STATS];
+	u64 latency[NUM_LATENCY_BUCKETS];
+};
+
+/*
+ * States of the circuit breaker for endpoint accesses. It opens after
+ * breaker_threshold consecutive failures, then lets a single access through
+ * every breaker_cooldown_ms until the device responds again.
  */
-static const u8 endpoint_get_fans = 0x1a;
+enum ccxt_breaker_state {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN, /* the next access decides */
+};
 
-/**
- * Endpoint to query the number of total supported temperature sensors
- * and the temperature reported by each connected sensor.
+struct ccxt_breaker {
+	enum ccxt_breaker_state state;
+	unsigned int failures; /* consecutive failed accesses */
+	int err; /* error of the last failed access, returned while open */
+	unsigned long open_until; /* jiffies */
+	u64 retries;
+	u64 trips;
+	u64 short_circuits; /* accesses refused while open */
+};
+
+enum ccxt_request_type {
+	REQUEST_READ,
+	REQUEST_PWM,
+};
+
+struct ccxt_device;
+
+/* a request for the dispatcher, see ccxt_dispatch_work() */
+struct ccxt_request {
+	struct list_head node;
+	enum ccxt_request_type type;
+	unsigned long sections; /* REQUEST_READ: snapshot sections to refresh */
+	bool force; /* REQUEST_READ: refresh even if the sections are fresh */
+	unsigned long channels; /* REQUEST_PWM: channels to write */
+	u8 duty[NUM_FANS]; /* REQUEST_PWM: duty cycles (0-100) */
+	int ret;
+	/* called with the result instead of completing done if set */
+	void (*complete)(struct ccxt_device *ccxt, struct ccxt_request *req);
+	struct completion done;
+};
+
+/*
+ * The character device, it outlives struct ccxt_device while files are
+ * still open.
  */
-static const u8 endpoint_get_temperatures = 0x21;
+struct ccxt_chardev {
+	struct kref kref;
+	struct miscdevice misc;
+	char name[32];
+	struct mutex lock; /* protects ccxt */
+	struct ccxt_device *ccxt; /* NULL once the device is gone */
+	wait_queue_head_t wait;
+	u64 seq; /* sequence number of the published snapshot */
+	bool polling; /* poll_interval_ms of the device is set, written under its mutex */
+};
 
-static const u8 data_type_set_speed[] = { 0x07, 0x00 };
+/* an open file of the character device */
+struct ccxt_reader {
+	struct ccxt_chardev *chardev;
+	u64 seq; /* sequence number of the last sample read */
+};
 
-struct firmware_version {
-	u8 major;
-	u8 minor;
-	u16 patch;
+/* piecewise linear mapping of temperature to pwm, points sorted by temperature */
+struct ccxt_curve {
+	long temp[CURVE_POINTS]; /* millidegree Celsius */
+	u8 pwm[CURVE_POINTS]; /* 0-255 */
 };
 
+/*
+ * The fields are grouped by who touches them, each group starting on its own
+ * cache line: the hwmon readers only look at the read-mostly part and the
+ * published snapshot, so they do not share lines with the fields written by
+ * the mutex holder, the request submitters or the fan control loop.
+ */
 struct ccxt_device {
+	/* set up in probe and setup, rarely written afterwards */
 	struct hid_device *hdev;
-	struct device *hwmon_dev;
+	struct device *hwmon_dev; /* set under mutex */
 	struct dentry *debugfs;
+	struct ccxt_chardev *chardev; /* set under mutex */
+	/*
+	 * Ordered queue of this device for the dispatcher and the works feeding
+	 * it without waiting (poller, pwm flush), so that a slow device only
+	 * delays its own requests. Works waiting for the dispatcher (fan control,
+	 * setup and rescan, which may wait for hwmon readers) use system_wq.
+	 */
+	struct workqueue_struct *wq;
+	unsigned int poll_interval_ms;
+	unsigned int pwm_flush_delay_ms;
+	unsigned int pwm_min_interval_ms;
+	struct work_struct setup_work;
+	struct delayed_work rescan_work;
+	bool removing; /* set under mutex, no more rescans */
+	/* rescan state for snapshot_check_hotplug(), protected by mutex */
+	bool rescanning;
+	unsigned long rescan_time; /* jiffies of the last rescan */
+	unsigned long hotplug_fans; /* undetected fans last seen spinning */
+	unsigned long hotplug_temps; /* undetected sensors last seen connected */
+	char fan_label[NUM_FANS][LABEL_LENGTH];
+	char temp_label[NUM_TEMP_SENSORS][LABEL_LENGTH];
+	struct firmware_version firmware_ver;
+	u8 bootloader_ver[2];
+
+	/* read-mostly, looked at by every hwmon read */
+	struct ccxt_snapshot __rcu *snapshot ____cacheline_aligned_in_smp;
+	unsigned int cache_time_ms;
+	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
+	DECLARE_BITMAP(fan_cnct, NUM_FANS);
+	/* each buffer starts on its own cache line */
+	struct ccxt_snapshot snapshot_buf[2];
+
+	/* writer side, used by the mutex holder and the input report handler */
+	struct mutex mutex ____cacheline_aligned_in_smp;
 	/* For reinitializing the completion below */
 	spinlock_t wait_input_report_lock;
 	struct completion wait_input_report;
-	struct mutex mutex;
-	/* whenever buffer is used, lock before send_usb_cmd */
-	u8 *cmd_buffer;
-	u8 *buffer;
-	/* required to store result of multistep get_data */
-	u8 *data_buffer;
+	/* commands waiting for their response, in order */
+	struct ccxt_inflight inflight[PIPELINE_MAX_DEPTH];
+	unsigned int inflight_sent;
+	unsigned int inflight_recv;
 	int buffer_recv_size; /* number of received bytes in buffer */
-	int data_buffer_recv_size; /* number of received bytes in data_buffer */
+	u64 foreign_reports; /* responses not matching the next inflight command */
+	/* protected by mutex, sends from cmd_buffer */
+	struct ccxt_proto_session session;
+	/* round trip time estimate (RFC 6298), 0 if unknown */
+	u32 srtt_us;
+	u32 rttvar_us;
+	unsigned int timeout_backoff; /* consecutive timeouts */
+	struct ccxt_breaker breaker; /* protected by mutex */
+	/* snapshot_buf entries replaced by a publish, until readers are done */
+	unsigned long snapshot_retired;
+	unsigned long snapshot_gp_state[2]; /* rcu grace period cookies of the retirement */
+	bool hardware_mode; /* device runs its own fan curves, written under mutex */
+	/* last duty cycles written to the device, protected by mutex */
+	unsigned long applied_channels;
+	u8 applied_duty[NUM_FANS];
+	unsigned long applied_time[NUM_FANS]; /* jiffies of the last write */
+	unsigned long pwm_synced; /* channels known to still run at applied_duty */
+	struct {
+		u64 written;
+		u64 unchanged;
+		u64 deferred;
+	} pwm_stats; /* channels of pwm writes, protected by mutex */
+	struct delayed_work poll_work;
+	/* alarms waiting for ccxt_alarm_work() */
+	unsigned long alarms_changed[NUM_ALARMS];
+	struct work_struct alarm_work;
+	struct ccxt_stats_entry cmd_stats[NUM_CMD_STATS];
+	struct ccxt_stats_entry endpoint_stats[NUM_ENDPOINT_STATS];
+
+	/* requests waiting for the dispatcher, protected by queue_lock */
+	spinlock_t queue_lock ____cacheline_aligned_in_smp;
+	struct list_head queue;
+	struct work_struct dispatch_work;
+	struct {
+		u64 requests;
+		u64 batches;
+	} queue_stats; /* only touched by the dispatcher */
+
+	/* pwm values waiting to be flushed, protected by pwm_pending_lock */
+	spinlock_t pwm_pending_lock ____cacheline_aligned_in_smp;
+	unsigned long pwm_pending; /* bitmask of channels */
+	unsigned long pwm_deferred; /* pending channels deferred by throttle_pwm() */
+	u8 pwm_pending_duty[NUM_FANS];
+	struct delayed_work pwm_flush_work;
+
+	/* fan control modes and curves, protected by control_lock */
+	struct mutex control_lock ____cacheline_aligned_in_smp;
+	u8 fan_mode[NUM_FANS]; /* FAN_MODE_* */
+	struct ccxt_curve curve[NUM_FANS];
+	u8 curve_temp_channels[NUM_FANS]; /* bitmask of sensors driving the curve */
+	long curve_temp[NUM_FANS]; /* temperature the curve was last evaluated at */
+	int control_pwm[NUM_FANS]; /* last pwm applied by the control loop, -1 if none */
+	long target_acc[NUM_FANS]; /* rpm controller output in 1/1000 pwm, -1 if unset */
+	long target_err[NUM_FANS]; /* rpm error of the previous run */
+	long curve_temp_hyst;
+	struct delayed_work control_work;
 	int target[NUM_FANS];
-	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
-	DECLARE_BITMAP(fan_cnct, NUM_FANS);
-	char fan_label[NUM_FANS][LABEL_LENGTH];
-	struct firmware_version firmware_ver;
-	u8 bootloader_ver[2];
+	long fan_min[NUM_FANS]; /* rpm, 0 disables the alarm */
+
+	/*
+	 * I/O buffers, allocated with the device. cmd_buffer is handed to the
+	 * USB core for DMA and must not share a cache line with other fields,
+	 * buffer receives copies of the input reports, protected by mutex.
+	 */
+	u8 cmd_buffer[OUT_BUFFER_SIZE] __aligned(ARCH_DMA_MINALIGN);
+	u8 buffer[IN_BUFFER_SIZE] __aligned(ARCH_DMA_MINALIGN);
 };
 
-/* converts response error in buffer to errno */
-static int ccxt_get_errno(struct ccxt_device *ccxt)
+/* converts the status byte of a response to errno */
+static int ccxt_get_errno(struct ccxt_device *ccxt, u8 status)
 {
-	switch (ccxt->buffer[0]) {
-	case 0x00: /* success */
-		return 0;
-	case 0x01: /* called invalid command */
-		return -EOPNOTSUPP;
-	case 0x10: /* called GET_VOLT / GET_TMP with invalid arguments */
-		return -EINVAL;
-	case 0x11: /* requested temps of disconnected sensors */
-	case 0x12: /* requested pwm of not pwm-controlled channels */
-		return -ENODATA;
-	default:
+	int ret = ccxt_proto_errno(status);
+
+	if (ret == -EIO)
 		hid_dbg(ccxt->hdev, "unknown device response error: %d",
-			ccxt->buffer[0]);
-		return -EIO;
+			status);
+	return ret;
+}
+
+static enum ccxt_cmd_stat cmd_stat_index(u8 cmd)
+{
+	if (cmd == cmd_software_mode[0])
+		return CMD_STAT_SET;
+	if (cmd == cmd_get_firmware[0])
+		return CMD_STAT_GET;
+	if (cmd == cmd_open_endpoint[0])
+		return CMD_STAT_OPEN;
+	if (cmd == cmd_close_endpoint[0])
+		return CMD_STAT_CLOSE;
+	if (cmd == cmd_read[0])
+		return CMD_STAT_READ;
+	if (cmd == cmd_write[0])
+		return CMD_STAT_WRITE;
+	return CMD_STAT_OTHER;
+}
+
+static enum ccxt_endpoint_stat endpoint_stat_index(u8 endpoint)
+{
+	if (endpoint == endpoint_fan_state)
+		return ENDPOINT_STAT_FAN_STATE;
+	if (endpoint == endpoint_fan_pwm)
+		return ENDPOINT_STAT_FAN_PWM;
+	if (endpoint == endpoint_get_fans)
+		return ENDPOINT_STAT_GET_FANS;
+	if (endpoint == endpoint_get_temperatures)
+		return ENDPOINT_STAT_GET_TEMPERATURES;
+	return ENDPOINT_STAT_OTHER;
+}
+
+/* account a request result and its latency, ccxt->mutex must be held */
+static void stats_account(struct ccxt_stats_entry *entry, int ret,
+			ktime_t latency)
+{
+	u64 latency_us = ktime_to_us(latency);
+	enum ccxt_result_stat result;
+
+	switch (ret) {
+	case 0:
+		result = RESULT_STAT_OK;
+		break;
+	case -ETIMEDOUT:
+		result = RESULT_STAT_TIMEOUT;
+		break;
+	case -EPROTO:
+		result = RESULT_STAT_PROTO;
+		break;
+	case -EOPNOTSUPP:
+		result = RESULT_STAT_UNSUPPORTED;
+		break;
+	case -EINVAL:
+		result = RESULT_STAT_INVALID;
+		break;
+	case -ENODATA:
+		result = RESULT_STAT_NODATA;
+		break;
+	case -EIO:
+		result = RESULT_STAT_IO;
+		break;
+	default:
+		result = RESULT_STAT_OTHER;
+		break;
 	}
+
+	entry->results[result]++;
+	entry->latency[min_t(int, latency_us ? ilog2(latency_us) + 1 : 0,
+			NUM_LATENCY_BUCKETS - 1)]++;
+}
+
+/* timeout for the next request, ccxt->mutex must be held */
+static unsigned long request_timeout_us(const struct ccxt_device *ccxt)
+{
+	unsigned long min_us = READ_ONCE(timeout_min_ms) * USEC_PER_MSEC;
+	unsigned long max_us = READ_ONCE(timeout_max_ms) * USEC_PER_MSEC;
+	unsigned long rto_us;
+
+	if (!ccxt->srtt_us)
+		return max(max_us, min_us);
+
+	rto_us = ccxt->srtt_us + 4 * ccxt->rttvar_us;
+	rto_us <<= min(ccxt->timeout_backoff, 8U);
+
+	return clamp(rto_us, min_us, max(max_us, min_us));
 }
 
-/* prepare ccxt->cmd_buffer with command and return used size */
-static int prepare_cmd(struct ccxt_device *ccxt, const u8 *command,
-			size_t command_len)
+/* update the round trip time estimate after a request, ccxt->mutex must be held */
+static void update_rtt(struct ccxt_device *ccxt, int ret, ktime_t latency)
 {
-	memset(ccxt->cmd_buffer, 0x00, OUT_BUFFER_SIZE);
-	ccxt->cmd_buffer[0] = 0x00;
-	ccxt->cmd_buffer[1] = 0x08;
-	memcpy(ccxt->cmd_buffer + CMD_HEADER_SIZE, command, command_len);
+	u32 rtt_us;
+
+	if (ret == -ETIMEDOUT) {
+		ccxt->timeout_backoff++;
+		return;
+	}
+
+	/* only requests that got a response are meaningful samples */
+	switch (ret) {
+	case 0:
+	case -EPROTO:
+	case -EOPNOTSUPP:
+	case -EINVAL:
+	case -ENODATA:
+	case -EIO:
+		break;
+	default:
+		return;
+	}
+
+	ccxt->timeout_backoff = 0;
+	rtt_us = max_t(u32, ktime_to_us(latency), 1);
 
-	return CMD_HEADER_SIZE + command_len;
+	if (!ccxt->srtt_us) {
+		ccxt->srtt_us = rtt_us;
+		ccxt->rttvar_us = rtt_us / 2;
+		return;
+	}
+
+	ccxt->rttvar_us = (3 * ccxt->rttvar_us +
+			abs_diff(ccxt->srtt_us, rtt_us)) / 4;
+	ccxt->srtt_us = (7 * ccxt->srtt_us + rtt_us) / 8;
 }
 
-/* prepare ccxt->cmd_buffer with command and single-valued endpoint and return used size */
-static int prepare_endpoint_cmd(struct ccxt_device *ccxt, const u8 *command,
-				size_t command_len, u8 endpoint)
+/* number of commands that may be in flight, ccxt->mutex must be held */
+static unsigned int pipeline_depth_active(const struct ccxt_device *ccxt)
 {
-	int ret = prepare_cmd(ccxt, command, command_len);
-	ccxt->cmd_buffer[ret] = endpoint;
-	return ret + 1;
+	/* older firmware is not known to queue commands */
+	if (ccxt->firmware_ver.major < PIPELINE_MIN_FW_MAJOR)
+		return 1;
+
+	return clamp(READ_ONCE(pipeline_depth), 1U, PIPELINE_MAX_DEPTH);
 }
 
-/* send current ccxt->cmd_buffer, check for error in response, response in ccxt->buffer */
-static int send_usb(struct ccxt_device *ccxt)
+/*
+ * send ccxt->cmd_buffer without waiting for the response, ccxt->mutex must be
+ * held. The response is collected by the next usb_wait().
+ */
+static int usb_submit(struct ccxt_device *ccxt)
 {
-	unsigned long t;
+	u8 cmd = ccxt->cmd_buffer[CMD_HEADER_SIZE];
+	ktime_t start = ktime_get();
 	int ret;
 
+	lockdep_assert_held(&ccxt->mutex);
+
+	if (WARN_ON_ONCE(ccxt->inflight_sent >= PIPELINE_MAX_DEPTH))
+		return -ENOSPC;
+
+	trace_ccxt_usb_tx(ccxt->hdev, ccxt->cmd_buffer + CMD_HEADER_SIZE);
+
 	/*
 	 * Disable raw event parsing for a moment to safely reinitialize the
 	 * completion. Reinit is done because hidraw could have triggered
@@ -179,50 +618,206 @@ static int send_usb(struct ccxt_device *ccxt)
 	 * completion as done.
 	 */
 	spin_lock_bh(&ccxt->wait_input_report_lock);
-	reinit_completion(&ccxt->wait_input_report);
+	if (ccxt->inflight_recv == ccxt->inflight_sent)
+		reinit_completion(&ccxt->wait_input_report);
+	ccxt->inflight[ccxt->inflight_sent].cmd = cmd;
+	ccxt->inflight[ccxt->inflight_sent].tx = start;
+	ccxt->inflight_sent++;
 	spin_unlock_bh(&ccxt->wait_input_report_lock);
 
 	ret = hid_hw_output_report(ccxt->hdev, ccxt->cmd_buffer,
 				OUT_BUFFER_SIZE);
-	if (ret < 0)
+	if (ret >= 0)
+		return 0;
+
+	/* responses to the commands sent before are ignored from now on */
+	spin_lock_bh(&ccxt->wait_input_report_lock);
+	ccxt->inflight_sent = 0;
+	ccxt->inflight_recv = 0;
+	spin_unlock_bh(&ccxt->wait_input_report_lock);
+
+	stats_account(&ccxt->cmd_stats[cmd_stat_index(cmd)], ret,
+		ktime_sub(ktime_get(), start));
+	trace_ccxt_usb_rx(ccxt->hdev, cmd, ret, 0, 0);
+
+	return ret;
+}
+
+/*
+ * wait for the responses to all submitted commands, ccxt->mutex must be held.
+ * Returns the first error, the last response is left in ccxt->buffer.
+ */
+static int usb_wait(struct ccxt_device *ccxt)
+{
+	struct ccxt_inflight inflight[PIPELINE_MAX_DEPTH];
+	unsigned int sent, recv, i;
+	ktime_t now, latency;
+	int ret = 0, err;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	sent = ccxt->inflight_sent;
+	if (!sent)
+		return 0;
+
+	wait_for_completion_timeout(&ccxt->wait_input_report,
+				usecs_to_jiffies(request_timeout_us(ccxt) * sent));
+
+	spin_lock_bh(&ccxt->wait_input_report_lock);
+	recv = ccxt->inflight_recv;
+	memcpy(inflight, ccxt->inflight, sizeof(inflight));
+	ccxt->inflight_sent = 0;
+	ccxt->inflight_recv = 0;
+	spin_unlock_bh(&ccxt->wait_input_report_lock);
+
+	now = ktime_get();
+
+	for (i = 0; i < sent; i++) {
+		if (i >= recv)
+			err = -ETIMEDOUT;
+		else if (inflight[i].size != IN_BUFFER_SIZE)
+			err = -EPROTO;
+		else
+			err = ccxt_get_errno(ccxt, inflight[i].status);
+
+		latency = ktime_sub(i < recv ? inflight[i].rx : now,
+				inflight[i].tx);
+
+		/* commands queued behind others don't measure the round trip */
+		if (!i || ktime_after(inflight[i].tx, inflight[i - 1].rx))
+			update_rtt(ccxt, err, latency);
+		stats_account(&ccxt->cmd_stats[cmd_stat_index(inflight[i].cmd)],
+			err, latency);
+
+		trace_ccxt_usb_rx(ccxt->hdev, inflight[i].cmd, err,
+				i < recv ? inflight[i].size : 0,
+				ktime_to_ns(latency));
+
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/* send current ccxt->cmd_buffer, check for error in response, response in ccxt->buffer */
+static int send_usb(struct ccxt_device *ccxt)
+{
+	int ret;
+
+	/* the last command of a sequence counts against the pipeline depth too */
+	if (ccxt->inflight_sent >= pipeline_depth_active(ccxt)) {
+		ret = usb_wait(ccxt);
+		if (ret)
+			return ret;
+	}
+
+	ret = usb_submit(ccxt);
+	if (ret)
 		return ret;
 
-	t = wait_for_completion_timeout(&ccxt->wait_input_report,
-					msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t)
-		return -ETIMEDOUT;
+	/* also collects the responses of commands queued before */
+	return usb_wait(ccxt);
+}
+
+/*
+ * send current ccxt->cmd_buffer as part of a command sequence, ccxt->mutex
+ * must be held. With pipelining the response is not waited for until the
+ * pipeline is full or the sequence ends with send_usb() or usb_wait(), so
+ * errors may show up there instead.
+ */
+static int queue_usb(struct ccxt_device *ccxt)
+{
+	int ret;
+
+	if (pipeline_depth_active(ccxt) == 1)
+		return send_usb(ccxt);
 
-	if (ccxt->buffer_recv_size != IN_BUFFER_SIZE)
-		return -EPROTO;
+	if (ccxt->inflight_sent >= pipeline_depth_active(ccxt)) {
+		ret = usb_wait(ccxt);
+		if (ret)
+			return ret;
+	}
 
-	return ccxt_get_errno(ccxt);
+	return usb_submit(ccxt);
 }
 
 static int ccxt_raw_event(struct hid_device *hdev, struct hid_report *report,
 			u8 *data, int size)
 {
 	struct ccxt_device *ccxt = hid_get_drvdata(hdev);
+	struct ccxt_inflight *inflight;
 
 	/* only copy buffer when requested */
 	spin_lock(&ccxt->wait_input_report_lock);
-	if (!completion_done(&ccxt->wait_input_report)) {
-		memcpy(ccxt->buffer, data, min(IN_BUFFER_SIZE, size));
-		ccxt->buffer_recv_size = size;
-		complete_all(&ccxt->wait_input_report);
+	if (ccxt->inflight_recv < ccxt->inflight_sent) {
+		inflight = &ccxt->inflight[ccxt->inflight_recv];
+
+		/*
+		 * keep waiting if this is the response to another command. A
+		 * hidraw user's response to the same command is taken as ours.
+		 */
+		if (size <= RESPONSE_CMD_INDEX ||
+		    data[RESPONSE_CMD_INDEX] != inflight->cmd) {
+			ccxt->foreign_reports++;
+			goto out_unlock;
+		}
+
+		/*
+		 * responses arrive in order and only the last one carries data
+		 * anyone looks at, so earlier ones of a pipeline aren't copied
+		 */
+		if (ccxt->inflight_recv + 1 == ccxt->inflight_sent) {
+			memcpy(ccxt->buffer, data, min(IN_BUFFER_SIZE, size));
+			ccxt->buffer_recv_size = size;
+		}
+		inflight->status = data[0];
+		inflight->size = size;
+		inflight->rx = ktime_get();
+
+		if (++ccxt->inflight_recv == ccxt->inflight_sent)
+			complete_all(&ccxt->wait_input_report);
 	}
+
+out_unlock:
 	spin_unlock(&ccxt->wait_input_report_lock);
 
 	return 0;
 }
 
+static int ccxt_transport_queue(void *priv)
+{
+	return queue_usb(priv);
+}
+
+static int ccxt_transport_send(void *priv)
+{
+	return send_usb(priv);
+}
+
+/* endpoint sessions run over the pipeline, see queue_usb() */
+static const struct ccxt_proto_transport ccxt_transport = {
+	.queue = ccxt_transport_queue,
+	.send = ccxt_transport_send,
+};
+
 static int set_hardware_mode(struct ccxt_device *ccxt)
 {
 	int ret;
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_cmd_safe(ccxt, cmd_hardware_mode);
+	/* don't leave an endpoint open when handing control back to the device */
+	ccxt_proto_close(&ccxt->session);
+	usb_wait(ccxt);
+
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_hardware_mode);
 	ret = send_usb(ccxt);
+	if (!ret) {
+		WRITE_ONCE(ccxt->hardware_mode, true);
+		/* the device changes the duty cycles on its own from now on */
+		ccxt->pwm_synced = 0;
+	}
 
 	mutex_unlock(&ccxt->mutex);
 	return ret;
@@ -234,8 +829,26 @@ static int set_software_mode(struct ccxt_device *ccxt)
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_cmd_safe(ccxt, cmd_software_mode);
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_software_mode);
+	ret = send_usb(ccxt);
+	if (!ret)
+		WRITE_ONCE(ccxt->hardware_mode, false);
+
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
+
+/* query whether the device is in hardware or software mode */
+static int get_mode(struct ccxt_device *ccxt, bool *hardware)
+{
+	int ret;
+
+	mutex_lock(&ccxt->mutex);
+
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_get_mode);
 	ret = send_usb(ccxt);
+	if (!ret)
+		ret = ccxt_proto_mode(ccxt->buffer, hardware);
 
 	mutex_unlock(&ccxt->mutex);
 	return ret;
@@ -248,17 +861,15 @@ static int get_fw_version(struct ccxt_device *ccxt)
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_cmd_safe(ccxt, cmd_get_firmware);
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_get_firmware);
 	ret = send_usb(ccxt);
 
 	if (ret) {
 		hid_notice(ccxt->hdev, "failed to read firmware version.\n");
 		goto out_unlock;
 	}
-	ccxt->firmware_ver.major = ccxt->buffer[3];
-	ccxt->firmware_ver.minor = ccxt->buffer[4];
-	ccxt->firmware_ver.patch = (u16)ccxt->buffer[5] | (u16)ccxt->buffer[6]
-				<< 8;
+	ccxt_proto_fw_version(ccxt->buffer, &ccxt->firmware_ver.major,
+			&ccxt->firmware_ver.minor, &ccxt->firmware_ver.patch);
 
 out_unlock:
 	mutex_unlock(&ccxt->mutex);
@@ -284,237 +895,1446 @@ static int get_bl_version(struct ccxt_device *ccxt)
 	return 0;*/
 }
 
-/* reads the data from the given endpoint and stores it in data_buffer */
-static int read_data(struct ccxt_device *ccxt, u8 endpoint)
+/*
+ * errors of an endpoint access worth retrying, the device didn't answer
+ * properly. Responses which arrived but fail to decode (-EBADMSG) show the
+ * device is alive and don't count.
+ */
+static bool access_failed(int err)
 {
-	int ret, i;
-
-	mutex_lock(&ccxt->mutex);
+	return err == -ETIMEDOUT || err == -EPROTO || err == -EIO;
+}
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+/*
+ * number of attempts the next endpoint access may take, 0 while the breaker
+ * is open. ccxt->mutex must be held.
+ */
+static unsigned int breaker_attempts(struct ccxt_device *ccxt)
+{
+	struct ccxt_breaker *breaker = &ccxt->breaker;
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_open_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	switch (breaker->state) {
+	case BREAKER_OPEN:
+		if (time_before(jiffies, breaker->open_until)) {
+			breaker->short_circuits++;
+			return 0;
+		}
+		breaker->state = BREAKER_HALF_OPEN;
+		fallthrough;
+	case BREAKER_HALF_OPEN:
+		/* a single probe without retries, don't stall longer than needed */
+		return 1;
+	case BREAKER_CLOSED:
+	default:
+		return 1 + min(READ_ONCE(retries), RETRIES_MAX);
+	}
+}
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_read, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+/* account the result of an endpoint access, ccxt->mutex must be held */
+static void breaker_record(struct ccxt_device *ccxt, int err)
+{
+	struct ccxt_breaker *breaker = &ccxt->breaker;
+	unsigned int threshold = READ_ONCE(breaker_threshold);
+
+	/* errors reported by the device still mean it responds */
+	if (!access_failed(err)) {
+		if (breaker->state != BREAKER_CLOSED)
+			hid_notice(ccxt->hdev, "device responds again\n");
+		breaker->state = BREAKER_CLOSED;
+		breaker->failures = 0;
+		return;
+	}
 
-	/* copy result to data buffer */
-	memcpy(ccxt->data_buffer, ccxt->buffer, IN_BUFFER_SIZE);
-	ccxt->data_buffer_recv_size = ccxt->buffer_recv_size;
+	breaker->err = err;
+	breaker->failures++;
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
+	if (breaker->state != BREAKER_HALF_OPEN &&
+	    (!threshold || breaker->failures < threshold))
+		return;
 
-out_unlock:
-	mutex_unlock(&ccxt->mutex);
-	return ret;
+	if (breaker->state == BREAKER_CLOSED)
+		hid_notice(ccxt->hdev,
+			"device not responding (%d), serving stale values\n",
+			err);
+	breaker->state = BREAKER_OPEN;
+	/* the device may come back with other duty cycles */
+	ccxt->pwm_synced = 0;
+	breaker->open_until = jiffies +
+		msecs_to_jiffies(READ_ONCE(breaker_cooldown_ms));
+	breaker->trips++;
 }
 
-static int write_data(struct ccxt_device *ccxt, u8 endpoint,
+/*
+ * read (data_type NULL) or write the given endpoint with bounded retries,
+ * ccxt->mutex must be held. A failed access leaves the endpoint state
+ * unknown, so the retry closes and reopens it. The backoff also lets late
+ * responses to the failed commands arrive while nothing is in flight, which
+ * keeps them from being taken for responses to the retry.
+ */
+static int access_endpoint(struct ccxt_device *ccxt, u8 endpoint,
 			const u8 *data_type, size_t data_type_size,
 			const u8 *data, size_t data_size)
 {
+	unsigned int attempt, attempts;
+	ktime_t start;
 	int ret;
-	u8 *writer_header_dst, *data_type_dst, *data_dst;
-
-	mutex_lock(&ccxt->mutex);
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	lockdep_assert_held(&ccxt->mutex);
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_open_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	attempts = breaker_attempts(ccxt);
+	if (!attempts)
+		return ccxt->breaker.err;
 
-	ret = prepare_cmd_safe(ccxt, cmd_write);
+	for (attempt = 0;; attempt++) {
+		start = ktime_get();
+		if (data_type)
+			ret = ccxt_proto_write(&ccxt->session, endpoint,
+					data_type, data_type_size, data,
+					data_size);
+		else
+			ret = ccxt_proto_read(&ccxt->session, endpoint);
+		stats_account(&ccxt->endpoint_stats[endpoint_stat_index(endpoint)],
+			ret, ktime_sub(ktime_get(), start));
 
-	/* compute header offsets */
-	writer_header_dst = ccxt->cmd_buffer + ret;
-	data_type_dst = writer_header_dst + WRITE_DATA_HEADER_SIZE;
-	data_dst = data_type_dst + data_type_size;
+		if (!access_failed(ret) || attempt + 1 >= attempts)
+			break;
 
-	writer_header_dst[0] = data_type_size + data_size;
-	memcpy(data_type_dst, data_type, data_type_size);
-	memcpy(data_dst, data, data_size);
+		ccxt->breaker.retries++;
+		msleep(RETRY_BACKOFF_MS <<
+		       min(attempt, RETRY_BACKOFF_MAX_SHIFT));
+	}
 
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	breaker_record(ccxt, ret);
 
-	/* copy result to data buffer */
-	memcpy(ccxt->data_buffer, ccxt->buffer, IN_BUFFER_SIZE);
+	return ret;
+}
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
+/*
+ * reads the data from the given endpoint, ccxt->mutex must be held. The
+ * response stays in ccxt->buffer until the next command is sent.
+ */
+static int read_data(struct ccxt_device *ccxt, u8 endpoint)
+{
+	return access_endpoint(ccxt, endpoint, NULL, 0, NULL, 0);
+}
 
-out_unlock:
-	mutex_unlock(&ccxt->mutex);
-	return ret;
+/* writes data of the given type to the endpoint, ccxt->mutex must be held */
+static int write_data(struct ccxt_device *ccxt, u8 endpoint,
+			const u8 *data_type, size_t data_type_size,
+			const u8 *data, size_t data_size)
+{
+	return access_endpoint(ccxt, endpoint, data_type, data_type_size,
+			data, data_size);
 }
 
 /* read fan connection status and set labels */
 static int get_fan_cnct(struct ccxt_device *ccxt)
 {
-	int ret, num_fans, channel, state;
+	DECLARE_BITMAP(fan_cnct, NUM_FANS);
+	int ret, num_fans, channel;
+
+	bitmap_zero(fan_cnct, NUM_FANS);
+
+	mutex_lock(&ccxt->mutex);
 
 	ret = read_data(ccxt, endpoint_get_fans);
 	if (ret)
-		return ret;
+		goto out_unlock;
 
 	/* The theoretical number of fans this controller supports */
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+	num_fans = ccxt_proto_fan_count(ccxt->buffer);
 
 	for (channel = 0; channel < min(num_fans, NUM_FANS); channel++) {
-		state = ccxt->data_buffer[FAN_DATA_OFFSET + channel];
-		if (state != FAN_STATE_OK)
+		if (!ccxt_proto_fan_connected(ccxt->buffer, channel))
 			continue;
 
-		set_bit(channel, ccxt->fan_cnct);
-		ccxt->target[channel] = -ENODATA;
+		__set_bit(channel, fan_cnct);
 
 		scnprintf(ccxt->fan_label[channel], LABEL_LENGTH, "fan%d",
 			channel + 1);
 	}
 
+	/* readers never see a partial result */
+	bitmap_copy(ccxt->fan_cnct, fan_cnct, NUM_FANS);
+
+out_unlock:
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
+
+static int decode_fan_state(struct ccxt_device *ccxt,
+			struct ccxt_snapshot *snap)
+{
+	int channel;
+
+	snap->num_fans = min_t(int, ccxt_proto_fan_count(ccxt->buffer),
+			NUM_FANS);
+
+	for (channel = 0; channel < snap->num_fans; channel++)
+		snap->rpm[channel] = ccxt_proto_rpm(ccxt->buffer, channel);
+
 	return 0;
 }
 
-/* read temp sensor connection status */
-static int get_temp_cnct(struct ccxt_device *ccxt)
+static int decode_fan_pwm(struct ccxt_device *ccxt, struct ccxt_snapshot *snap)
 {
-	int ret, num_sensors, channel, state;
+	int num_fans, channel, pwm;
+
+	num_fans = min_t(int, ccxt_proto_fan_count(ccxt->buffer), NUM_FANS);
+
+	for (channel = 0; channel < num_fans; channel++) {
+		/* validates the channel id of the response */
+		pwm = ccxt_proto_pwm(ccxt->buffer, channel);
+		if (pwm < 0) {
+			dev_notice_ratelimited(&ccxt->hdev->dev,
+				"invalid fan id in response for channel %d\n",
+				channel);
+			return pwm;
+		}
 
-	ret = read_data(ccxt, endpoint_get_temperatures);
+		snap->pwm[channel] = pwm;
+	}
+
+	return 0;
+}
+
+static int decode_temperatures(struct ccxt_device *ccxt,
+			struct ccxt_snapshot *snap)
+{
+	int channel;
+
+	snap->num_temp_sensors = min_t(int,
+			ccxt_proto_temp_count(ccxt->buffer), NUM_TEMP_SENSORS);
+	bitmap_zero(snap->temp_cnct, NUM_TEMP_SENSORS);
+
+	for (channel = 0; channel < snap->num_temp_sensors; channel++) {
+		if (!ccxt_proto_temp(ccxt->buffer, channel,
+				&snap->temp[channel]))
+			set_bit(channel, snap->temp_cnct);
+	}
+
+	return 0;
+}
+
+/* the endpoint backing a snapshot section */
+static u8 section_endpoint(enum ccxt_snapshot_section section)
+{
+	switch (section) {
+	case SNAPSHOT_FAN_STATE:
+		return endpoint_fan_state;
+	case SNAPSHOT_FAN_PWM:
+		return endpoint_fan_pwm;
+	case SNAPSHOT_TEMPERATURES:
+	default:
+		return endpoint_get_temperatures;
+	}
+}
+
+/* read and decode one snapshot section, ccxt->mutex must be held */
+static int read_snapshot_section(struct ccxt_device *ccxt,
+				enum ccxt_snapshot_section section,
+				struct ccxt_snapshot *snap)
+{
+	int ret;
+
+	ret = read_data(ccxt, section_endpoint(section));
 	if (ret)
 		return ret;
 
-	/* The theoretical number of temperature sensors this controller supports */
-	num_sensors = ccxt->data_buffer[TEMP_CNT_INDEX];
-
-	for (
-		channel = 0;
-		channel < min(num_sensors, NUM_TEMP_SENSORS);
-		channel++
-	) {
-		state = ccxt->data_buffer[TEMP_DATA_OFFSET + channel];
-		/*mode = ccxt->buffer[channel + 1];
-		if (mode == 0)
+	switch (section) {
+	case SNAPSHOT_FAN_STATE:
+		return decode_fan_state(ccxt, snap);
+	case SNAPSHOT_FAN_PWM:
+		return decode_fan_pwm(ccxt, snap);
+	case SNAPSHOT_TEMPERATURES:
+		return decode_temperatures(ccxt, snap);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* whether a section of the snapshot may be served without asking the device */
+static bool snapshot_fresh(const struct ccxt_device *ccxt,
+			const struct ccxt_snapshot *snap,
+			enum ccxt_snapshot_section section)
+{
+	/* never read */
+	if (!test_bit(section, &snap->valid) && !snap->err[section])
+		return false;
+
+	/* the poller keeps the snapshot up to date */
+	if (READ_ONCE(ccxt->poll_interval_ms))
+		return true;
+
+	return time_before(jiffies, snap->updated[section] +
+			msecs_to_jiffies(READ_ONCE(ccxt->cache_time_ms)));
+}
+
+/* index of a snapshot in snapshot_buf, -1 if it was allocated */
+static int snapshot_buf_index(const struct ccxt_device *ccxt,
+			const struct ccxt_snapshot *snap)
+{
+	if (snap == &ccxt->snapshot_buf[0])
+		return 0;
+	if (snap == &ccxt->snapshot_buf[1])
+		return 1;
+	return -1;
+}
+
+/* whether readers may still see the given entry of snapshot_buf */
+static bool snapshot_buf_busy(struct ccxt_device *ccxt, int i)
+{
+	if (!test_bit(i, &ccxt->snapshot_retired))
+		return false;
+	if (!poll_state_synchronize_rcu(ccxt->snapshot_gp_state[i]))
+		return true;
+
+	__clear_bit(i, &ccxt->snapshot_retired);
+	return false;
+}
+
+/*
+ * Get a writable copy of the published snapshot, ccxt->mutex must be held.
+ * An entry of snapshot_buf not published and no longer seen by readers is
+ * reused. If readers may still see both, e.g. when a pwm write and a read
+ * of the same batch publish right after each other, a copy is allocated
+ * instead of waiting for an rcu grace period with the mutex held. Only if
+ * that fails the wait is taken.
+ */
+static struct ccxt_snapshot *snapshot_begin(struct ccxt_device *ccxt)
+{
+	struct ccxt_snapshot *cur, *next;
+	int i;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	cur = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex));
+
+	for (i = 0; i < ARRAY_SIZE(ccxt->snapshot_buf); i++) {
+		if (&ccxt->snapshot_buf[i] != cur &&
+		    !snapshot_buf_busy(ccxt, i))
+			goto out_copy;
+	}
+
+	next = kmalloc(sizeof(*next), GFP_KERNEL);
+	if (next) {
+		*next = *cur;
+		return next;
+	}
+
+	i = cur == &ccxt->snapshot_buf[0];
+	cond_synchronize_rcu(ccxt->snapshot_gp_state[i]);
+	__clear_bit(i, &ccxt->snapshot_retired);
+
+out_copy:
+	next = &ccxt->snapshot_buf[i];
+	*next = *cur;
+
+	return next;
+}
+
+/* derive the alarms from the values of a snapshot, sections not read keep theirs */
+static void snapshot_update_alarms(const struct ccxt_device *ccxt,
+				struct ccxt_snapshot *snap)
+{
+	long min;
+	int channel;
+
+	if (test_bit(SNAPSHOT_FAN_STATE, &snap->valid)) {
+		for (channel = 0; channel < NUM_FANS; channel++) {
+			min = READ_ONCE(ccxt->fan_min[channel]);
+			__assign_bit(channel, &snap->alarms[ALARM_FAN_MIN],
+				test_bit(channel, ccxt->fan_cnct) &&
+				channel < snap->num_fans && min &&
+				snap->rpm[channel] < min);
+			__assign_bit(channel, &snap->alarms[ALARM_FAN_FAULT],
+				test_bit(channel, ccxt->fan_cnct) &&
+				channel < snap->num_fans &&
+				test_bit(SNAPSHOT_FAN_PWM, &snap->valid) &&
+				!snap->rpm[channel] && snap->pwm[channel]);
+		}
+	}
+
+	if (test_bit(SNAPSHOT_TEMPERATURES, &snap->valid)) {
+		for (channel = 0; channel < NUM_TEMP_SENSORS; channel++)
+			__assign_bit(channel, &snap->alarms[ALARM_TEMP_FAULT],
+				test_bit(channel, ccxt->temp_cnct) &&
+				!test_bit(channel, snap->temp_cnct));
+	}
+
+	/* stale values are faults of every connected channel */
+	if (test_bit(SNAPSHOT_FAN_STATE, &snap->stale))
+		snap->alarms[ALARM_FAN_FAULT] = ccxt->fan_cnct[0];
+	if (test_bit(SNAPSHOT_TEMPERATURES, &snap->stale))
+		snap->alarms[ALARM_TEMP_FAULT] = ccxt->temp_cnct[0];
+}
+
+/*
+ * Tell hwmon about alarms that changed, without ccxt->mutex held: a thermal
+ * zone bound to the hwmon device reads the temperatures from the notifier,
+ * which has to wait for the dispatcher.
+ */
+static void ccxt_alarm_work(struct work_struct *work)
+{
+	static const struct {
+		enum hwmon_sensor_types type;
+		u32 attr;
+	} alarm_attrs[NUM_ALARMS] = {
+		[ALARM_FAN_MIN] = { hwmon_fan, hwmon_fan_min_alarm },
+		[ALARM_FAN_FAULT] = { hwmon_fan, hwmon_fan_fault },
+		[ALARM_TEMP_FAULT] = { hwmon_temp, hwmon_temp_fault },
+	};
+	struct ccxt_device *ccxt =
+		container_of(work, struct ccxt_device, alarm_work);
+	unsigned long changed[NUM_ALARMS], channel;
+	struct device *hwmon_dev;
+	int alarm;
+
+	/* the hwmon device is only unregistered after this work is done */
+	mutex_lock(&ccxt->mutex);
+	hwmon_dev = ccxt->hwmon_dev;
+	memcpy(changed, ccxt->alarms_changed, sizeof(changed));
+	memset(ccxt->alarms_changed, 0, sizeof(ccxt->alarms_changed));
+	mutex_unlock(&ccxt->mutex);
+
+	if (!hwmon_dev)
+		return;
+
+	for (alarm = 0; alarm < NUM_ALARMS; alarm++) {
+		for_each_set_bit(channel, &changed[alarm], BITS_PER_LONG)
+			hwmon_notify_event(hwmon_dev, alarm_attrs[alarm].type,
+					alarm_attrs[alarm].attr, channel);
+	}
+}
+
+/* collect alarms that changed for ccxt_alarm_work(), ccxt->mutex must be held */
+static void snapshot_notify_alarms(struct ccxt_device *ccxt,
+				const struct ccxt_snapshot *prev,
+				const struct ccxt_snapshot *next)
+{
+	unsigned long changed = 0;
+	int alarm;
+
+	if (!ccxt->hwmon_dev)
+		return;
+
+	for (alarm = 0; alarm < NUM_ALARMS; alarm++) {
+		ccxt->alarms_changed[alarm] |=
+			prev->alarms[alarm] ^ next->alarms[alarm];
+		changed |= ccxt->alarms_changed[alarm];
+	}
+
+	if (changed)
+		schedule_work(&ccxt->alarm_work);
+}
+
+/* queue a rescan of the connected channels, ccxt->mutex must be held */
+static void schedule_rescan(struct ccxt_device *ccxt, unsigned long delay)
+{
+	lockdep_assert_held(&ccxt->mutex);
+
+	/* nothing to update before setup or during removal */
+	if (!ccxt->hwmon_dev || ccxt->removing)
+		return;
+
+	mod_delayed_work(system_wq, &ccxt->rescan_work, delay);
+}
+
+/*
+ * Hint at newly connected channels: sensors show up in every temperature
+ * read, fans spin on channels not detected so far. Only channels appearing
+ * since the previous snapshot trigger a rescan, so a fan the device keeps
+ * reporting as disconnected while it spins doesn't cause one rescan after
+ * the other. Publishes of the rescan itself and rescans within
+ * HOTPLUG_RESCAN_DELAY_MS or poll_interval_ms of the last one are held
+ * back. Disconnected channels stay registered to report their fault until
+ * rescanned explicitly.
+ */
+static void snapshot_check_hotplug(struct ccxt_device *ccxt,
+				const struct ccxt_snapshot *snap)
+{
+	unsigned long fans = 0, temps = 0, appeared = 0, next;
+	int channel;
+
+	if (test_bit(SNAPSHOT_TEMPERATURES, &snap->valid)) {
+		bitmap_andnot(&temps, snap->temp_cnct, ccxt->temp_cnct,
+			NUM_TEMP_SENSORS);
+		appeared |= temps & ~ccxt->hotplug_temps;
+		ccxt->hotplug_temps = temps;
+	}
+
+	if (test_bit(SNAPSHOT_FAN_STATE, &snap->valid)) {
+		for (channel = 0; channel < snap->num_fans; channel++) {
+			if (snap->rpm[channel] > 0 &&
+			    !test_bit(channel, ccxt->fan_cnct))
+				__set_bit(channel, &fans);
+		}
+		appeared |= fans & ~ccxt->hotplug_fans;
+		ccxt->hotplug_fans = fans;
+	}
+
+	if (!appeared || ccxt->rescanning)
+		return;
+
+	next = ccxt->rescan_time + msecs_to_jiffies(
+		max_t(unsigned int, READ_ONCE(ccxt->poll_interval_ms),
+		      HOTPLUG_RESCAN_DELAY_MS));
+	schedule_rescan(ccxt, time_before(jiffies, next) ? next - jiffies : 0);
+}
+
+/* publish a snapshot obtained from snapshot_begin(), ccxt->mutex must be held */
+static void snapshot_publish(struct ccxt_device *ccxt,
+			struct ccxt_snapshot *next)
+{
+	struct ccxt_snapshot *prev;
+	int i;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	prev = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex));
+
+	next->seq++;
+	next->timestamp_ns = ktime_get_ns();
+	snapshot_update_alarms(ccxt, next);
+
+	rcu_assign_pointer(ccxt->snapshot, next);
+
+	snapshot_notify_alarms(ccxt, prev, next);
+	snapshot_check_hotplug(ccxt, next);
+
+	/* prev stays readable until readers are done with it */
+	i = snapshot_buf_index(ccxt, prev);
+	if (i < 0) {
+		kfree_rcu(prev, rcu);
+	} else {
+		ccxt->snapshot_gp_state[i] = get_state_synchronize_rcu();
+		__set_bit(i, &ccxt->snapshot_retired);
+	}
+
+	if (ccxt->chardev) {
+		WRITE_ONCE(ccxt->chardev->seq, next->seq);
+		wake_up_interruptible(&ccxt->chardev->wait);
+	}
+}
+
+/*
+ * Refresh the given snapshot sections and publish the result, ccxt->mutex must be held.
+ * Unless force is set, sections which are still fresh are not read again.
+ * Sections which fail to update are marked invalid and keep the error for readers,
+ * the first error is returned. If the device didn't respond, the values read
+ * before are kept and marked stale instead.
+ */
+static int update_snapshot(struct ccxt_device *ccxt, unsigned long sections,
+			bool force)
+{
+	const struct ccxt_snapshot *cur;
+	struct ccxt_snapshot *next;
+	unsigned long section;
+	int ret = 0, err;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	cur = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex));
+
+	if (!force) {
+		for_each_set_bit(section, &sections, NUM_SNAPSHOT_SECTIONS) {
+			if (snapshot_fresh(ccxt, cur, section))
+				__clear_bit(section, &sections);
+		}
+		if (!sections)
+			return 0;
+	}
+
+	next = snapshot_begin(ccxt);
+
+	for_each_set_bit(section, &sections, NUM_SNAPSHOT_SECTIONS) {
+		err = read_snapshot_section(ccxt, section, next);
+		next->err[section] = err;
+		next->updated[section] = jiffies;
+
+		if (err) {
+			/* readers keep getting the last values, flagged as faults */
+			if (test_bit(section, &next->valid) && access_failed(err))
+				__set_bit(section, &next->stale);
+			else if (!access_failed(err))
+				__clear_bit(section, &next->stale);
+			__clear_bit(section, &next->valid);
+			if (!ret)
+				ret = err;
 			continue;
+		}
 
-		set_bit(channel, ccxt->temp_cnct);*/
+		__set_bit(section, &next->valid);
+		__clear_bit(section, &next->stale);
 	}
 
-	return -1;
+	snapshot_publish(ccxt, next);
+
+	return ret;
 }
 
-static int get_fan_rpm(struct ccxt_device *ccxt, int channel, long *val)
+/*
+ * read temp sensor connection status and set labels. The values read along
+ * with it are published in the snapshot.
+ */
+static int get_temp_cnct(struct ccxt_device *ccxt)
 {
-	int ret, num_fans, data_index;
+	const struct ccxt_snapshot *snap;
+	int ret, channel;
+
+	mutex_lock(&ccxt->mutex);
 
-	ret = read_data(ccxt, endpoint_fan_state);
+	ret = update_snapshot(ccxt, BIT(SNAPSHOT_TEMPERATURES), true);
 	if (ret)
+		goto out_unlock;
+
+	snap = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex));
+	bitmap_copy(ccxt->temp_cnct, snap->temp_cnct, NUM_TEMP_SENSORS);
+
+	for_each_set_bit(channel, ccxt->temp_cnct, NUM_TEMP_SENSORS)
+		scnprintf(ccxt->temp_label[channel], LABEL_LENGTH, "temp%d",
+			channel + 1);
+
+out_unlock:
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
+
+/* extract a single value from a snapshot section */
+static int snapshot_value(struct ccxt_device *ccxt,
+			const struct ccxt_snapshot *snap,
+			enum ccxt_snapshot_section section, int channel,
+			long *val)
+{
+	if (snap->err[section] && !test_bit(section, &snap->stale))
+		return snap->err[section];
+
+	switch (section) {
+	case SNAPSHOT_FAN_STATE:
+		if (channel >= snap->num_fans)
+			break;
+		*val = snap->rpm[channel];
+		return 0;
+	case SNAPSHOT_FAN_PWM:
+		if (channel >= snap->num_fans)
+			break;
+		*val = snap->pwm[channel];
+		return 0;
+	case SNAPSHOT_TEMPERATURES:
+		if (channel >= snap->num_temp_sensors)
+			break;
+		if (!test_bit(channel, snap->temp_cnct))
+			return -ENODATA;
+		*val = snap->temp[channel];
+		return 0;
+	default:
+		break;
+	}
+
+	dev_dbg_ratelimited(&ccxt->hdev->dev, "invalid channel %d\n", channel);
+	return -EINVAL;
+}
+
+/*
+ * set the duty cycle (0-100) of all given channels in a single write,
+ * ccxt->mutex must be held
+ */
+static int write_pwm(struct ccxt_device *ccxt, const u8 *duty,
+		unsigned long channels)
+{
+	u8 speed_cmd[1 + NUM_FANS * FAN_PWM_DATA_SIZE];
+	struct ccxt_snapshot *snap;
+	unsigned long channel;
+	size_t size;
+	int ret;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	/* the device ignores pwm values while running its own curves */
+	if (ccxt->hardware_mode)
+		return -EBUSY;
+
+	size = ccxt_proto_encode_pwm(speed_cmd, duty, channels, NUM_FANS);
+	if (!speed_cmd[0])
+		return 0;
+
+	ret = write_data(ccxt, endpoint_fan_pwm, data_type_set_speed,
+			sizeof(data_type_set_speed), speed_cmd, size);
+
+	for_each_set_bit(channel, &channels, NUM_FANS)
+		trace_ccxt_write(ccxt->hdev, endpoint_fan_pwm, channel,
+				duty[channel], ret);
+
+	if (ret) {
+		/* the device may or may not have taken the new values */
+		ccxt->pwm_synced &= ~channels;
 		return ret;
+	}
 
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+	/* restored after resume */
+	for_each_set_bit(channel, &channels, NUM_FANS) {
+		ccxt->applied_duty[channel] = duty[channel];
+		ccxt->applied_time[channel] = jiffies;
+	}
+	ccxt->applied_channels |= channels;
+	ccxt->pwm_synced |= channels;
+	ccxt->pwm_stats.written += hweight_long(channels);
 
-	if (channel >= min(num_fans, NUM_FANS)) {
-		hid_notice(ccxt->hdev, "invalid fan channel %d\n", channel);
-		return -EINVAL;
+	/* readers of the snapshot should see the new values right away */
+	snap = snapshot_begin(ccxt);
+	for_each_set_bit(channel, &channels, NUM_FANS)
+		snap->pwm[channel] = DIV_ROUND_CLOSEST(duty[channel] * 255, 100);
+	snapshot_publish(ccxt, snap);
+
+	return 0;
+}
+
+/*
+ * Drop the channels of a pwm write that would leave the device at its
+ * current duty cycle and defer the ones written less than
+ * pwm_min_interval_ms ago to the pwm flush. The dispatcher handles requests
+ * in order, so a deferred value replaces whatever is pending for its
+ * channel, and channels dropped or written now cancel values deferred
+ * before. Values collected for pwm_flush_delay_ms after this request was
+ * queued are newer and stay pending. Nothing is deferred once the device is being removed, the
+ * flush is cancelled by then. Returns the channels to write now,
+ * ccxt->mutex must be held.
+ */
+static unsigned long throttle_pwm(struct ccxt_device *ccxt, const u8 *duty,
+		unsigned long channels)
+{
+	unsigned long interval =
+		msecs_to_jiffies(READ_ONCE(ccxt->pwm_min_interval_ms));
+	unsigned long now = jiffies, deferred = 0, delay = 0;
+	unsigned long requested = channels;
+	unsigned long channel;
+
+	lockdep_assert_held(&ccxt->mutex);
+
+	for_each_set_bit(channel, &channels, NUM_FANS) {
+		unsigned long next = ccxt->applied_time[channel] + interval;
+
+		if (test_bit(channel, &ccxt->pwm_synced) &&
+		    ccxt->applied_duty[channel] == duty[channel]) {
+			__clear_bit(channel, &channels);
+			ccxt->pwm_stats.unchanged++;
+		} else if (interval && !ccxt->removing &&
+			   test_bit(channel, &ccxt->applied_channels) &&
+			   time_before(now, next)) {
+			__clear_bit(channel, &channels);
+			__set_bit(channel, &deferred);
+			delay = max(delay, next - now);
+			ccxt->pwm_stats.deferred++;
+		}
 	}
 
-	/* two bytes per value */
-	data_index = FAN_DATA_OFFSET + channel * 2;
+	spin_lock(&ccxt->pwm_pending_lock);
+	ccxt->pwm_pending &= ~(requested & ~deferred & ccxt->pwm_deferred);
+	ccxt->pwm_deferred &= ~requested;
+	for_each_set_bit(channel, &deferred, NUM_FANS)
+		ccxt->pwm_pending_duty[channel] = duty[channel];
+	ccxt->pwm_pending |= deferred;
+	ccxt->pwm_deferred |= deferred;
+	spin_unlock(&ccxt->pwm_pending_lock);
+
+	if (deferred)
+		queue_delayed_work(ccxt->wq, &ccxt->pwm_flush_work, delay);
 
-	*val = (s16)((u16)ccxt->data_buffer[data_index] |
-			(u16)ccxt->data_buffer[data_index + 1] << 8);
+	return channels;
+}
+
+/* first error of the given snapshot sections */
+static int snapshot_error(const struct ccxt_snapshot *snap,
+			unsigned long sections)
+{
+	unsigned long section;
 
-	hid_notice(ccxt->hdev, "fan%d rpm changed to %ld\n", channel, *val);
+	for_each_set_bit(section, &sections, NUM_SNAPSHOT_SECTIONS) {
+		if (snap->err[section])
+			return snap->err[section];
+	}
 
 	return 0;
 }
 
+/*
+ * Requests are queued and executed by a single dispatcher, which owns the
+ * transport while it runs. All requests queued by the time it runs form a
+ * batch: reads of the batch are merged into one refresh of the union of
+ * their sections and pwm writes into one write, with later values of a
+ * channel replacing earlier ones.
+ */
+static void ccxt_dispatch_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(work, struct ccxt_device, dispatch_work);
+	const struct ccxt_snapshot *snap;
+	struct ccxt_request *req, *tmp;
+	unsigned long sections = 0, forced = 0, channels = 0;
+	unsigned long channel;
+	u8 duty[NUM_FANS];
+	int pwm_ret = 0;
+	LIST_HEAD(batch);
+
+	spin_lock(&ccxt->queue_lock);
+	list_splice_init(&ccxt->queue, &batch);
+	spin_unlock(&ccxt->queue_lock);
+
+	if (list_empty(&batch))
+		return;
+
+	list_for_each_entry(req, &batch, node) {
+		switch (req->type) {
+		case REQUEST_READ:
+			sections |= req->sections;
+			if (req->force)
+				forced |= req->sections;
+			break;
+		case REQUEST_PWM:
+			for_each_set_bit(channel, &req->channels, NUM_FANS)
+				duty[channel] = req->duty[channel];
+			channels |= req->channels;
+			break;
+		}
+		ccxt->queue_stats.requests++;
+	}
+	ccxt->queue_stats.batches++;
+
+	mutex_lock(&ccxt->mutex);
+
+	/* write first, so that reads of the same batch see the new values */
+	if (channels && !ccxt->hardware_mode)
+		channels = throttle_pwm(ccxt, duty, channels);
+	if (channels)
+		pwm_ret = write_pwm(ccxt, duty, channels);
+	if (forced)
+		update_snapshot(ccxt, forced, true);
+	if (sections & ~forced)
+		update_snapshot(ccxt, sections & ~forced, false);
+
+	snap = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex));
+	list_for_each_entry(req, &batch, node)
+		req->ret = req->type == REQUEST_PWM ?
+			pwm_ret : snapshot_error(snap, req->sections);
+
+	mutex_unlock(&ccxt->mutex);
+
+	/* waiters may free their request as soon as it is completed */
+	list_for_each_entry_safe(req, tmp, &batch, node) {
+		list_del(&req->node);
+		if (req->complete)
+			req->complete(ccxt, req);
+		else
+			complete(&req->done);
+	}
+}
+
+/* queue a request for the dispatcher */
+static void submit_request(struct ccxt_device *ccxt, struct ccxt_request *req)
+{
+	spin_lock(&ccxt->queue_lock);
+	list_add_tail(&req->node, &ccxt->queue);
+	spin_unlock(&ccxt->queue_lock);
+
+	queue_work(ccxt->wq, &ccxt->dispatch_work);
+}
+
+/* queue a request and wait for its result */
+static int submit_request_wait(struct ccxt_device *ccxt,
+			struct ccxt_request *req)
+{
+	req->complete = NULL;
+	init_completion(&req->done);
+
+	submit_request(ccxt, req);
+	wait_for_completion(&req->done);
+
+	return req->ret;
+}
+
+/* allocate a request to be submitted without waiting, complete() frees it */
+static struct ccxt_request *
+alloc_request(enum ccxt_request_type type,
+	void (*complete)(struct ccxt_device *ccxt, struct ccxt_request *req))
+{
+	struct ccxt_request *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	req->type = type;
+	req->complete = complete;
+
+	return req;
+}
+
+static void free_request(struct ccxt_device *ccxt, struct ccxt_request *req)
+{
+	kfree(req);
+}
+
+/* refresh the given snapshot sections through the request queue */
+static int request_read(struct ccxt_device *ccxt, unsigned long sections,
+			bool force)
+{
+	struct ccxt_request req = {
+		.type = REQUEST_READ,
+		.sections = sections,
+		.force = force,
+	};
+
+	return submit_request_wait(ccxt, &req);
+}
+
+/*
+ * read a single value, served from the published snapshot if it is fresh.
+ * Otherwise all stale sections are refreshed at once, so that reading every
+ * attribute of the device in turn only costs a single sweep.
+ */
+static int get_snapshot_value(struct ccxt_device *ccxt,
+			enum ccxt_snapshot_section section, int channel,
+			long *val)
+{
+	const struct ccxt_snapshot *snap;
+	int ret = -EAGAIN;
+
+	rcu_read_lock();
+	snap = rcu_dereference(ccxt->snapshot);
+	if (snapshot_fresh(ccxt, snap, section))
+		ret = snapshot_value(ccxt, snap, section, channel, val);
+	rcu_read_unlock();
+
+	if (ret != -EAGAIN) {
+		trace_ccxt_read(ccxt->hdev, section_endpoint(section), channel,
+				ret ? 0 : *val, ret, true);
+		return ret;
+	}
+
+	/* errors of the requested section are kept in the snapshot */
+	request_read(ccxt, SNAPSHOT_ALL, false);
+
+	rcu_read_lock();
+	snap = rcu_dereference(ccxt->snapshot);
+	ret = snapshot_value(ccxt, snap, section, channel, val);
+	rcu_read_unlock();
+
+	trace_ccxt_read(ccxt->hdev, section_endpoint(section), channel,
+			ret ? 0 : *val, ret, false);
+
+	return ret;
+}
+
+/* refresh all stale snapshot sections in one pass */
+static int ccxt_sweep(struct ccxt_device *ccxt)
+{
+	return request_read(ccxt, SNAPSHOT_ALL, false);
+}
+
+/* convert the published snapshot to the userspace layout */
+static void fill_sample(struct ccxt_device *ccxt, struct ccxt_sample *sample)
+{
+	const struct ccxt_snapshot *snap;
+	int channel;
+
+	BUILD_BUG_ON(CCXT_SAMPLE_FANS != NUM_FANS);
+	BUILD_BUG_ON(CCXT_SAMPLE_TEMP_SENSORS != NUM_TEMP_SENSORS);
+
+	memset(sample, 0, sizeof(*sample));
+	sample->version = CCXT_SAMPLE_VERSION;
+	sample->size = sizeof(*sample);
+	sample->fan_cnct = ccxt->fan_cnct[0];
+
+	rcu_read_lock();
+	snap = rcu_dereference(ccxt->snapshot);
+
+	sample->seq = snap->seq;
+	sample->timestamp_ns = snap->timestamp_ns;
+	sample->num_fans = snap->num_fans;
+	sample->num_temp_sensors = snap->num_temp_sensors;
+	sample->temp_cnct = snap->temp_cnct[0];
+
+	if (test_bit(SNAPSHOT_FAN_STATE, &snap->valid))
+		sample->valid |= CCXT_SAMPLE_VALID_RPM;
+	if (test_bit(SNAPSHOT_FAN_PWM, &snap->valid))
+		sample->valid |= CCXT_SAMPLE_VALID_PWM;
+	if (test_bit(SNAPSHOT_TEMPERATURES, &snap->valid))
+		sample->valid |= CCXT_SAMPLE_VALID_TEMP;
+	if (test_bit(SNAPSHOT_FAN_STATE, &snap->stale))
+		sample->valid |= CCXT_SAMPLE_STALE_RPM;
+	if (test_bit(SNAPSHOT_FAN_PWM, &snap->stale))
+		sample->valid |= CCXT_SAMPLE_STALE_PWM;
+	if (test_bit(SNAPSHOT_TEMPERATURES, &snap->stale))
+		sample->valid |= CCXT_SAMPLE_STALE_TEMP;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		sample->rpm[channel] = snap->rpm[channel];
+		sample->pwm[channel] = snap->pwm[channel];
+	}
+	for (channel = 0; channel < NUM_TEMP_SENSORS; channel++)
+		sample->temp[channel] = snap->temp[channel];
+
+	rcu_read_unlock();
+}
+
+static int get_temp(struct ccxt_device *ccxt, int channel, long *val)
+{
+	return get_snapshot_value(ccxt, SNAPSHOT_TEMPERATURES, channel, val);
+}
+
+static int get_fan_rpm(struct ccxt_device *ccxt, int channel, long *val)
+{
+	return get_snapshot_value(ccxt, SNAPSHOT_FAN_STATE, channel, val);
+}
+
 static int get_fan_pwm(struct ccxt_device *ccxt, int channel, long *val)
 {
-	int ret, num_fans, data_index, id, pwm;
+	return get_snapshot_value(ccxt, SNAPSHOT_FAN_PWM, channel, val);
+}
+
+/* read an alarm of a channel, refreshing the values it is based on if stale */
+static int get_alarm(struct ccxt_device *ccxt, enum ccxt_alarm alarm,
+		int channel, long *val)
+{
+	const struct ccxt_snapshot *snap;
+	long value;
+	int ret;
+
+	if (alarm == ALARM_TEMP_FAULT)
+		ret = get_temp(ccxt, channel, &value);
+	else
+		ret = get_fan_rpm(ccxt, channel, &value);
+	/* a disconnected sensor is what the temperature fault reports */
+	if (ret && ret != -ENODATA)
+		return ret;
+
+	rcu_read_lock();
+	snap = rcu_dereference(ccxt->snapshot);
+	*val = test_bit(channel, &snap->alarms[alarm]);
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/*
+ * queue a write of the duty cycles (0-100) of the given channels. Waits for
+ * the result if complete is NULL, otherwise complete() gets called with it.
+ */
+static int request_pwm(struct ccxt_device *ccxt, const u8 *duty,
+		unsigned long channels,
+		void (*complete)(struct ccxt_device *ccxt,
+				struct ccxt_request *req))
+{
+	struct ccxt_request sync_req = { .type = REQUEST_PWM };
+	struct ccxt_request *req = &sync_req;
+	unsigned long channel;
+
+	if (complete) {
+		req = alloc_request(REQUEST_PWM, complete);
+		if (!req)
+			return -ENOMEM;
+	}
+
+	req->channels = channels;
+	for_each_set_bit(channel, &channels, NUM_FANS)
+		req->duty[channel] = duty[channel];
+
+	if (!complete)
+		return submit_request_wait(ccxt, req);
+
+	submit_request(ccxt, req);
+	return 0;
+}
+
+/*
+ * apply duty cycles (0-100) to the given channels, either right away or
+ * merged with other updates after pwm_flush_delay_ms. With complete, the
+ * immediate write doesn't wait for the device, see request_pwm().
+ */
+static int commit_pwm(struct ccxt_device *ccxt, const u8 *duty,
+		unsigned long channels,
+		void (*complete)(struct ccxt_device *ccxt,
+				struct ccxt_request *req))
+{
+	unsigned int delay = READ_ONCE(ccxt->pwm_flush_delay_ms);
+	unsigned long channel;
+
+	if (READ_ONCE(ccxt->hardware_mode))
+		return -EBUSY;
+
+	spin_lock(&ccxt->pwm_pending_lock);
+	if (delay) {
+		for_each_set_bit(channel, &channels, NUM_FANS)
+			ccxt->pwm_pending_duty[channel] = duty[channel];
+		ccxt->pwm_pending |= channels;
+	} else {
+		/* a pending flush must not overwrite these values */
+		ccxt->pwm_pending &= ~channels;
+	}
+	ccxt->pwm_deferred &= ~channels;
+	spin_unlock(&ccxt->pwm_pending_lock);
+
+	if (delay) {
+		/* the window starts with the first pending write */
+		queue_delayed_work(ccxt->wq, &ccxt->pwm_flush_work,
+				msecs_to_jiffies(delay));
+		return 0;
+	}
+
+	return request_pwm(ccxt, duty, channels, complete);
+}
+
+static void pwm_flush_done(struct ccxt_device *ccxt, struct ccxt_request *req)
+{
+	if (req->ret)
+		dev_warn_ratelimited(&ccxt->hdev->dev,
+			"failed to apply pwm values: %d\n", req->ret);
+	kfree(req);
+}
+
+/* send all pending pwm values in one request */
+static void ccxt_pwm_flush_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(to_delayed_work(work), struct ccxt_device,
+			pwm_flush_work);
+	unsigned long channels;
+	u8 duty[NUM_FANS];
+	int ret;
+
+	spin_lock(&ccxt->pwm_pending_lock);
+	channels = ccxt->pwm_pending;
+	memcpy(duty, ccxt->pwm_pending_duty, sizeof(duty));
+	ccxt->pwm_pending = 0;
+	ccxt->pwm_deferred = 0;
+	spin_unlock(&ccxt->pwm_pending_lock);
+
+	if (!channels)
+		return;
+
+	ret = request_pwm(ccxt, duty, channels, pwm_flush_done);
+	if (ret)
+		dev_warn_ratelimited(&ccxt->hdev->dev,
+			"failed to apply pwm values: %d\n", ret);
+}
+
+static int set_pwm(struct ccxt_device *ccxt, int channel, long val)
+{
+	u8 duty[NUM_FANS];
+
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	/* the fan is under automatic control */
+	if (READ_ONCE(ccxt->fan_mode[channel]) != FAN_MODE_MANUAL)
+		return -EBUSY;
+
+	/* Corsair uses values from 0-100 */
+	duty[channel] = DIV_ROUND_CLOSEST(val * 100, 255);
+
+	return commit_pwm(ccxt, duty, BIT(channel), NULL);
+}
+
+/* set the pwm values (0-255) of all connected fans in manual mode at once */
+static int set_pwm_all(struct ccxt_device *ccxt, const long *val)
+{
+	unsigned long channels = 0;
+	u8 duty[NUM_FANS];
+	int channel;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (!test_bit(channel, ccxt->fan_cnct) ||
+		    READ_ONCE(ccxt->fan_mode[channel]) != FAN_MODE_MANUAL)
+			continue;
+		if (val[channel] < 0 || val[channel] > 255)
+			return -EINVAL;
+
+		duty[channel] = DIV_ROUND_CLOSEST(val[channel] * 100, 255);
+		__set_bit(channel, &channels);
+	}
+
+	return commit_pwm(ccxt, duty, channels, NULL);
+}
+
+/* pwm value of the curve at the given temperature */
+static int curve_eval(const struct ccxt_curve *curve, long temp)
+{
+	int i;
+
+	if (temp <= curve->temp[0])
+		return curve->pwm[0];
+
+	for (i = 1; i < CURVE_POINTS; i++) {
+		if (temp >= curve->temp[i])
+			continue;
+
+		/* curve->temp[i - 1] <= temp < curve->temp[i] */
+		return curve->pwm[i - 1] +
+			DIV_ROUND_CLOSEST((temp - curve->temp[i - 1]) *
+					(curve->pwm[i] - curve->pwm[i - 1]),
+					curve->temp[i] - curve->temp[i - 1]);
+	}
+
+	return curve->pwm[CURVE_POINTS - 1];
+}
+
+/* hottest of the given connected sensors */
+static int curve_input_temp(const struct ccxt_snapshot *snap,
+			unsigned long sensors, long *temp)
+{
+	unsigned long channel;
+	int ret = -ENODATA;
+
+	if (!test_bit(SNAPSHOT_TEMPERATURES, &snap->valid))
+		return ret;
+
+	for_each_set_bit(channel, &sensors, NUM_TEMP_SENSORS) {
+		if (!test_bit(channel, snap->temp_cnct))
+			continue;
+		if (ret || snap->temp[channel] > *temp)
+			*temp = snap->temp[channel];
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/* pwm for a channel following its fan curve, ccxt->control_lock must be held */
+static int control_curve(struct ccxt_device *ccxt,
+			const struct ccxt_snapshot *snap, int channel)
+{
+	long temp;
+
+	/* fail safe without a usable sensor */
+	if (curve_input_temp(snap, ccxt->curve_temp_channels[channel], &temp))
+		return 255;
+
+	/* falling temperatures are only followed after dropping by the hysteresis */
+	if (ccxt->control_pwm[channel] < 0 ||
+	    temp > ccxt->curve_temp[channel] ||
+	    temp + ccxt->curve_temp_hyst <= ccxt->curve_temp[channel])
+		ccxt->curve_temp[channel] = temp;
+
+	return curve_eval(&ccxt->curve[channel], ccxt->curve_temp[channel]);
+}
+
+/*
+ * pwm for a channel following its rpm target, ccxt->control_lock must be held.
+ * This is a PI controller in velocity form, clamping the output also keeps the
+ * integral part from winding up. Returns -ENODATA if the fan speed is unknown.
+ */
+static int control_target(struct ccxt_device *ccxt,
+			const struct ccxt_snapshot *snap, int channel,
+			unsigned int interval_ms)
+{
+	long err;
+
+	if (!test_bit(SNAPSHOT_FAN_STATE, &snap->valid) ||
+	    channel >= snap->num_fans)
+		return -ENODATA;
+
+	err = ccxt->target[channel] - snap->rpm[channel];
+
+	if (ccxt->target_acc[channel] < 0) {
+		/* start from the current duty cycle */
+		if (test_bit(SNAPSHOT_FAN_PWM, &snap->valid))
+			ccxt->target_acc[channel] = snap->pwm[channel] * 1000;
+		else if (ccxt->control_pwm[channel] >= 0)
+			ccxt->target_acc[channel] =
+				ccxt->control_pwm[channel] * 1000;
+		else
+			ccxt->target_acc[channel] = 128 * 1000;
+		ccxt->target_err[channel] = err;
+	}
+
+	ccxt->target_acc[channel] +=
+		TARGET_KP * (err - ccxt->target_err[channel]) +
+		DIV_ROUND_CLOSEST(TARGET_KI * err * (long)interval_ms, 1000);
+	ccxt->target_acc[channel] =
+		clamp_val(ccxt->target_acc[channel], 0, 255 * 1000);
+	ccxt->target_err[channel] = err;
+
+	return DIV_ROUND_CLOSEST(ccxt->target_acc[channel], 1000);
+}
+
+static void control_pwm_failed(struct ccxt_device *ccxt, unsigned long channels,
+			int ret)
+{
+	unsigned long channel;
+
+	/* retried on every run while the device is unavailable */
+	dev_warn_ratelimited(&ccxt->hdev->dev,
+			"failed to apply fan control: %d\n", ret);
+
+	/* retry on the next run */
+	mutex_lock(&ccxt->control_lock);
+	for_each_set_bit(channel, &channels, NUM_FANS)
+		ccxt->control_pwm[channel] = -1;
+	mutex_unlock(&ccxt->control_lock);
+}
+
+static void control_pwm_done(struct ccxt_device *ccxt, struct ccxt_request *req)
+{
+	if (req->ret)
+		control_pwm_failed(ccxt, req->channels, req->ret);
+	kfree(req);
+}
+
+/* evaluate curves and rpm targets of all channels in automatic mode, send changed values */
+static void ccxt_control_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(to_delayed_work(work), struct ccxt_device,
+			control_work);
+	unsigned int interval = READ_ONCE(control_interval_ms);
+	const struct ccxt_snapshot *snap;
+	unsigned long channels = 0;
+	unsigned long channel;
+	bool active = false;
+	u8 duty[NUM_FANS];
+	int pwm, ret;
+
+	request_read(ccxt, BIT(SNAPSHOT_TEMPERATURES) | BIT(SNAPSHOT_FAN_STATE),
+		false);
+
+	mutex_lock(&ccxt->control_lock);
+	rcu_read_lock();
+	snap = rcu_dereference(ccxt->snapshot);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (ccxt->fan_mode[channel] == FAN_MODE_MANUAL)
+			continue;
+
+		active = true;
 
-	ret = read_data(ccxt, endpoint_fan_pwm);
-	if (ret)
-		return ret;
+		/* the device is in control, keep running to resume afterwards */
+		if (READ_ONCE(ccxt->hardware_mode))
+			continue;
 
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+		if (ccxt->fan_mode[channel] == FAN_MODE_CURVE)
+			pwm = control_curve(ccxt, snap, channel);
+		else
+			pwm = control_target(ccxt, snap, channel, interval);
 
-	if (channel >= min(num_fans, NUM_FANS)) {
-		hid_notice(ccxt->hdev, "invalid fan channel %d\n", channel);
-		return -EINVAL;
+		if (pwm < 0 || pwm == ccxt->control_pwm[channel])
+			continue;
+
+		ccxt->control_pwm[channel] = pwm;
+		duty[channel] = DIV_ROUND_CLOSEST(pwm * 100, 255);
+		__set_bit(channel, &channels);
 	}
 
-	data_index = FAN_DATA_OFFSET + channel * 4;
+	rcu_read_unlock();
+	mutex_unlock(&ccxt->control_lock);
 
-	/* validate channel id from response */
-	id = ccxt->data_buffer[data_index];
-	if (id != channel) {
-		hid_notice(ccxt->hdev,
-			"invalid fan id %d in response for channel %d\n", id,
-			channel);
-		return -EIO;
+	if (channels) {
+		ret = commit_pwm(ccxt, duty, channels, control_pwm_done);
+		if (ret)
+			control_pwm_failed(ccxt, channels, ret);
 	}
 
-	pwm = ccxt->data_buffer[data_index + 2];
+	if (active)
+		schedule_delayed_work(&ccxt->control_work,
+				msecs_to_jiffies(interval));
+}
 
-	*val = DIV_ROUND_CLOSEST(pwm * 255, 100);
+/* switch a channel to the given mode, ccxt->control_lock must be held */
+static void set_fan_mode(struct ccxt_device *ccxt, int channel, u8 mode)
+{
+	lockdep_assert_held(&ccxt->control_lock);
 
-	hid_notice(ccxt->hdev, "fan%d pwm changed to %ld\n", channel, *val);
+	if (mode != FAN_MODE_TARGET)
+		ccxt->target[channel] = -ENODATA;
+	if (mode != ccxt->fan_mode[channel])
+		ccxt->target_acc[channel] = -1;
 
-	return 0;
+	WRITE_ONCE(ccxt->fan_mode[channel], mode);
+	/* apply the result on the next run even if the value didn't change */
+	ccxt->control_pwm[channel] = -1;
 }
 
-static int set_pwm(struct ccxt_device *ccxt, int channel, long val)
+static int set_pwm_enable(struct ccxt_device *ccxt, int channel, long val)
 {
-	int ret;
+	int ret = 0;
 
-	if (val < 0 || val > 255)
+	if (val != FAN_MODE_MANUAL && val != FAN_MODE_CURVE &&
+	    val != FAN_MODE_TARGET)
 		return -EINVAL;
 
-	/* Corsair uses values from 0-100 */
-	val = DIV_ROUND_CLOSEST(val * 100, 255);
-
-	/* {count, id, mode, val, 0x00} */
-	const u8 speed_cmd[5] = { 1, channel, 0, val, 0x00 };
-	ret = write_data(ccxt, endpoint_fan_pwm, data_type_set_speed,
-			sizeof(data_type_set_speed), speed_cmd,
-			sizeof(speed_cmd));
-	if (!ret)
-		ccxt->target[channel] = -ENODATA;
+	mutex_lock(&ccxt->control_lock);
+	/* fan*_target must be set first */
+	if (val == FAN_MODE_TARGET && ccxt->target[channel] < 0)
+		ret = -ENODATA;
+	else
+		set_fan_mode(ccxt, channel, val);
+	mutex_unlock(&ccxt->control_lock);
 
-	hid_notice(ccxt->hdev, "fan%d pwm set to %ld\n", channel, val);
+	if (!ret && val != FAN_MODE_MANUAL)
+		mod_delayed_work(system_wq, &ccxt->control_work, 0);
 
 	return ret;
 }
 
+static int set_pwm_auto_channels_temp(struct ccxt_device *ccxt, int channel,
+				long val)
+{
+	if (val < 0 || val >= BIT(NUM_TEMP_SENSORS))
+		return -EINVAL;
+
+	mutex_lock(&ccxt->control_lock);
+	ccxt->curve_temp_channels[channel] = val;
+	mutex_unlock(&ccxt->control_lock);
+
+	return 0;
+}
+
+/*
+ * The device has no known command for rpm targets, so the driver adjusts
+ * the pwm value until the fan runs at the requested speed.
+ */
 static int set_target(struct ccxt_device *ccxt, int channel, long val)
 {
-	int ret;
+	if (READ_ONCE(ccxt->hardware_mode))
+		return -EBUSY;
 
 	val = clamp_val(val, 0, 0xFFFF);
+
+	mutex_lock(&ccxt->control_lock);
+	set_fan_mode(ccxt, channel, FAN_MODE_TARGET);
 	ccxt->target[channel] = val;
+	mutex_unlock(&ccxt->control_lock);
 
-	mutex_lock(&ccxt->mutex);
-	ret = -1;
-	// send_usb_cmd(ccxt, CTL_SET_FAN_TARGET, channel, val >> 8, val);
+	mod_delayed_work(system_wq, &ccxt->control_work, 0);
 
-	mutex_unlock(&ccxt->mutex);
-	return ret;
+	return 0;
+}
+
+/* refresh all snapshot sections in the background */
+static void ccxt_poll_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(to_delayed_work(work), struct ccxt_device,
+			poll_work);
+	struct ccxt_request *req;
+	unsigned int interval;
+
+	/* the next run is scheduled right away, the dispatcher merges overlaps */
+	req = alloc_request(REQUEST_READ, free_request);
+	if (req) {
+		req->sections = SNAPSHOT_ALL;
+		req->force = true;
+		submit_request(ccxt, req);
+	}
+
+	interval = READ_ONCE(ccxt->poll_interval_ms);
+	if (interval)
+		queue_delayed_work(ccxt->wq, &ccxt->poll_work,
+				msecs_to_jiffies(interval));
 }
 
 static int ccxt_read_string(struct device *dev, enum hwmon_sensor_types type,
@@ -523,6 +2343,15 @@ static int ccxt_read_string(struct device *dev, enum hwmon_sensor_types type,
 	struct ccxt_device *ccxt = dev_get_drvdata(dev);
 
 	switch (type) {
+	case hwmon_temp:
+		switch (attr) {
+		case hwmon_temp_label:
+			*str = ccxt->temp_label[channel];
+			return 0;
+		default:
+			break;
+		}
+		break;
 	case hwmon_fan:
 		switch (attr) {
 		case hwmon_fan_label:
@@ -549,11 +2378,12 @@ static int ccxt_read(struct device *dev, enum hwmon_sensor_types type, u32 attr,
 	case hwmon_temp:
 		switch (attr) {
 		case hwmon_temp_input:
-			ret = 0; // get_data(ccxt, CTL_GET_TMP, channel, true);
+			ret = get_temp(ccxt, channel, val);
 			if (ret < 0)
 				return ret;
-			*val = (s16)ret * 10;
 			return 0;
+		case hwmon_temp_fault:
+			return get_alarm(ccxt, ALARM_TEMP_FAULT, channel, val);
 		default:
 			break;
 		}
@@ -566,12 +2396,19 @@ static int ccxt_read(struct device *dev, enum hwmon_sensor_types type, u32 attr,
 				return ret;
 			return 0;
 		case hwmon_fan_target:
-			/* how to read target values from the device is unknown */
-			/* driver returns last set value or 0			*/
-			if (ccxt->target[channel] < 0)
-				return -ENODATA;
-			*val = ccxt->target[channel];
+			/* the target is only known while the driver follows it */
+			ret = READ_ONCE(ccxt->target[channel]);
+			if (ret < 0)
+				return ret;
+			*val = ret;
 			return 0;
+		case hwmon_fan_min:
+			*val = READ_ONCE(ccxt->fan_min[channel]);
+			return 0;
+		case hwmon_fan_min_alarm:
+			return get_alarm(ccxt, ALARM_FAN_MIN, channel, val);
+		case hwmon_fan_fault:
+			return get_alarm(ccxt, ALARM_FAN_FAULT, channel, val);
 		default:
 			break;
 		}
@@ -583,17 +2420,11 @@ static int ccxt_read(struct device *dev, enum hwmon_sensor_types type, u32 attr,
 			if (ret < 0)
 				return ret;
 			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_in:
-		switch (attr) {
-		case hwmon_in_input:
-			ret = 0; // get_data(ccxt, CTL_GET_VOLT, channel, true);
-			if (ret < 0)
-				return ret;
-			*val = ret;
+		case hwmon_pwm_enable:
+			*val = READ_ONCE(ccxt->fan_mode[channel]);
+			return 0;
+		case hwmon_pwm_auto_channels_temp:
+			*val = READ_ONCE(ccxt->curve_temp_channels[channel]);
 			return 0;
 		default:
 			break;
@@ -616,6 +2447,10 @@ static int ccxt_write(struct device *dev, enum hwmon_sensor_types type,
 		switch (attr) {
 		case hwmon_pwm_input:
 			return set_pwm(ccxt, channel, val);
+		case hwmon_pwm_enable:
+			return set_pwm_enable(ccxt, channel, val);
+		case hwmon_pwm_auto_channels_temp:
+			return set_pwm_auto_channels_temp(ccxt, channel, val);
 		default:
 			break;
 		}
@@ -624,6 +2459,10 @@ static int ccxt_write(struct device *dev, enum hwmon_sensor_types type,
 		switch (attr) {
 		case hwmon_fan_target:
 			return set_target(ccxt, channel, val);
+		case hwmon_fan_min:
+			/* takes effect with the next refresh */
+			WRITE_ONCE(ccxt->fan_min[channel], clamp_val(val, 0, 0xFFFF));
+			return 0;
 		default:
 			break;
 		}
@@ -650,6 +2489,8 @@ static umode_t ccxt_is_visible(const void *data, enum hwmon_sensor_types type,
 			return 0444;
 		case hwmon_temp_label:
 			return 0444;
+		case hwmon_temp_fault:
+			return 0444;
 		default:
 			break;
 		}
@@ -665,6 +2506,12 @@ static umode_t ccxt_is_visible(const void *data, enum hwmon_sensor_types type,
 			return 0444;
 		case hwmon_fan_target:
 			return 0644;
+		case hwmon_fan_min:
+			return 0644;
+		case hwmon_fan_min_alarm:
+			return 0444;
+		case hwmon_fan_fault:
+			return 0444;
 		default:
 			break;
 		}
@@ -676,14 +2523,10 @@ static umode_t ccxt_is_visible(const void *data, enum hwmon_sensor_types type,
 		switch (attr) {
 		case hwmon_pwm_input:
 			return 0644;
-		default:
-			break;
-		}
-		break;
-	case hwmon_in:
-		switch (attr) {
-		case hwmon_in_input:
-			return 0444;
+		case hwmon_pwm_enable:
+			return 0644;
+		case hwmon_pwm_auto_channels_temp:
+			return 0644;
 		default:
 			break;
 		}
@@ -702,26 +2545,428 @@ static const struct hwmon_ops ccxt_hwmon_ops = {
 	.write = ccxt_write,
 };
 
-static const struct hwmon_channel_info *const ccxt_info[] = {
-	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT, HWMON_T_INPUT, HWMON_T_INPUT,
-			HWMON_T_INPUT),
-	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET),
-	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT, HWMON_PWM_INPUT,
-			HWMON_PWM_INPUT, HWMON_PWM_INPUT, HWMON_PWM_INPUT,
-			HWMON_PWM_INPUT),
-	HWMON_CHANNEL_INFO(in, HWMON_I_INPUT, HWMON_I_INPUT, HWMON_I_INPUT),
-	NULL
+static const struct hwmon_channel_info *const ccxt_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ),
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_FAULT,
+			HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_FAULT),
+	HWMON_CHANNEL_INFO(fan,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT,
+			HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET |
+				HWMON_F_MIN | HWMON_F_MIN_ALARM | HWMON_F_FAULT),
+	HWMON_CHANNEL_INFO(pwm,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP,
+			HWMON_PWM_INPUT | HWMON_PWM_ENABLE | HWMON_PWM_AUTO_CHANNELS_TEMP),
+	NULL
+};
+
+static const struct hwmon_chip_info ccxt_chip_info = {
+	.ops = &ccxt_hwmon_ops,
+	.info = ccxt_info,
+};
+
+static ssize_t cache_time_ms_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccxt->cache_time_ms));
+}
+
+static ssize_t cache_time_ms_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ccxt->cache_time_ms, val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(cache_time_ms);
+
+static ssize_t poll_interval_ms_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccxt->poll_interval_ms));
+}
+
+static ssize_t poll_interval_ms_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ccxt->poll_interval_ms, val);
+
+	/* readers waiting for the poller sweep themselves from now on */
+	mutex_lock(&ccxt->mutex);
+	if (ccxt->chardev) {
+		WRITE_ONCE(ccxt->chardev->polling, val);
+		if (!val)
+			wake_up_interruptible(&ccxt->chardev->wait);
+	}
+	mutex_unlock(&ccxt->mutex);
+
+	/* a disabled poller does not rearm itself */
+	if (val)
+		mod_delayed_work(ccxt->wq, &ccxt->poll_work, 0);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(poll_interval_ms);
+
+static ssize_t pwm_flush_delay_ms_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccxt->pwm_flush_delay_ms));
+}
+
+static ssize_t pwm_flush_delay_ms_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ccxt->pwm_flush_delay_ms, val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(pwm_flush_delay_ms);
+
+static ssize_t pwm_min_interval_ms_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccxt->pwm_min_interval_ms));
+}
+
+static ssize_t pwm_min_interval_ms_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ccxt->pwm_min_interval_ms, val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(pwm_min_interval_ms);
+
+/* takes one pwm value (0-255) per fan channel, values of disconnected channels are ignored */
+static ssize_t pwm_all_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	long val[NUM_FANS];
+	int ret;
+
+	ret = sscanf(buf, "%ld %ld %ld %ld %ld %ld", &val[0], &val[1], &val[2],
+		&val[3], &val[4], &val[5]);
+	if (ret != NUM_FANS)
+		return -EINVAL;
+
+	ret = set_pwm_all(ccxt, val);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static DEVICE_ATTR_WO(pwm_all);
+
+static ssize_t curve_temp_hyst_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%ld\n", READ_ONCE(ccxt->curve_temp_hyst));
+}
+
+static ssize_t curve_temp_hyst_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ccxt->control_lock);
+	WRITE_ONCE(ccxt->curve_temp_hyst, clamp_val(val, 0, 100000));
+	mutex_unlock(&ccxt->control_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(curve_temp_hyst);
+
+/* hardware: the device runs its stored fan curves, software: the driver controls the fans */
+static ssize_t control_mode_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	bool hardware;
+	int ret;
+
+	ret = get_mode(ccxt, &hardware);
+	if (ret) {
+		/* fall back to the last mode set by the driver */
+		hid_dbg(ccxt->hdev, "failed to query mode: %d\n", ret);
+		hardware = READ_ONCE(ccxt->hardware_mode);
+	}
+
+	return sysfs_emit(buf, "%s\n", hardware ? "hardware" : "software");
+}
+
+static ssize_t control_mode_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	int ret, channel;
+
+	if (sysfs_streq(buf, "hardware")) {
+		ret = set_hardware_mode(ccxt);
+	} else if (sysfs_streq(buf, "software")) {
+		ret = set_software_mode(ccxt);
+		if (ret)
+			return ret;
+
+		/* reapply fan curves */
+		mutex_lock(&ccxt->control_lock);
+		for (channel = 0; channel < NUM_FANS; channel++)
+			ccxt->control_pwm[channel] = -1;
+		mutex_unlock(&ccxt->control_lock);
+		mod_delayed_work(system_wq, &ccxt->control_work, 0);
+	} else {
+		return -EINVAL;
+	}
+
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(control_mode);
+
+static ssize_t rescan_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	/* this attribute goes away if the channels changed */
+	if (val) {
+		mutex_lock(&ccxt->mutex);
+		schedule_rescan(ccxt, 0);
+		mutex_unlock(&ccxt->mutex);
+	}
+
+	return count;
+}
+
+static DEVICE_ATTR_WO(rescan);
+
+static struct attribute *ccxt_attrs[] = {
+	&dev_attr_cache_time_ms.attr,
+	&dev_attr_poll_interval_ms.attr,
+	&dev_attr_pwm_all.attr,
+	&dev_attr_pwm_flush_delay_ms.attr,
+	&dev_attr_pwm_min_interval_ms.attr,
+	&dev_attr_curve_temp_hyst.attr,
+	&dev_attr_control_mode.attr,
+	&dev_attr_rescan.attr,
+	NULL
+};
+
+static const struct attribute_group ccxt_group = {
+	.attrs = ccxt_attrs,
+};
+
+/* index is the fan channel, nr the curve point */
+static ssize_t auto_point_temp_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	long val;
+
+	mutex_lock(&ccxt->control_lock);
+	val = ccxt->curve[sattr->index].temp[sattr->nr];
+	mutex_unlock(&ccxt->control_lock);
+
+	return sysfs_emit(buf, "%ld\n", val);
+}
+
+static ssize_t auto_point_temp_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ccxt->control_lock);
+	ccxt->curve[sattr->index].temp[sattr->nr] =
+		clamp_val(val, -128000, 127000);
+	mutex_unlock(&ccxt->control_lock);
+
+	return count;
+}
+
+static ssize_t auto_point_pwm_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	int val;
+
+	mutex_lock(&ccxt->control_lock);
+	val = ccxt->curve[sattr->index].pwm[sattr->nr];
+	mutex_unlock(&ccxt->control_lock);
+
+	return sysfs_emit(buf, "%d\n", val);
+}
+
+static ssize_t auto_point_pwm_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccxt_device *ccxt = dev_get_drvdata(dev);
+	u8 val;
+	int ret;
+
+	ret = kstrtou8(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ccxt->control_lock);
+	ccxt->curve[sattr->index].pwm[sattr->nr] = val;
+	mutex_unlock(&ccxt->control_lock);
+
+	return count;
+}
+
+#define CURVE_POINT_ATTRS(ch, pt)                                             \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_temp,       \
+				auto_point_temp, pt - 1, ch - 1);             \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_pwm,        \
+				auto_point_pwm, pt - 1, ch - 1)
+
+#define CURVE_ATTRS(ch)                                                        \
+	CURVE_POINT_ATTRS(ch, 1);                                              \
+	CURVE_POINT_ATTRS(ch, 2);                                              \
+	CURVE_POINT_ATTRS(ch, 3);                                              \
+	CURVE_POINT_ATTRS(ch, 4)
+
+#define CURVE_POINT_ATTR_PTRS(ch, pt)                                         \
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_temp.dev_attr.attr,       \
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_pwm.dev_attr.attr
+
+#define CURVE_ATTR_PTRS(ch)                                                    \
+	CURVE_POINT_ATTR_PTRS(ch, 1), CURVE_POINT_ATTR_PTRS(ch, 2),            \
+	CURVE_POINT_ATTR_PTRS(ch, 3), CURVE_POINT_ATTR_PTRS(ch, 4)
+
+CURVE_ATTRS(1);
+CURVE_ATTRS(2);
+CURVE_ATTRS(3);
+CURVE_ATTRS(4);
+CURVE_ATTRS(5);
+CURVE_ATTRS(6);
+
+static struct attribute *ccxt_curve_attrs[] = {
+	CURVE_ATTR_PTRS(1),
+	CURVE_ATTR_PTRS(2),
+	CURVE_ATTR_PTRS(3),
+	CURVE_ATTR_PTRS(4),
+	CURVE_ATTR_PTRS(5),
+	CURVE_ATTR_PTRS(6),
+	NULL
+};
+
+static umode_t ccxt_curve_attr_visible(struct kobject *kobj,
+				struct attribute *attr, int n)
+{
+	struct ccxt_device *ccxt = dev_get_drvdata(kobj_to_dev(kobj));
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(
+		container_of(attr, struct device_attribute, attr));
+
+	if (!test_bit(sattr->index, ccxt->fan_cnct))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccxt_curve_group = {
+	.attrs = ccxt_curve_attrs,
+	.is_visible = ccxt_curve_attr_visible,
 };
 
-static const struct hwmon_chip_info ccxt_chip_info = {
-	.ops = &ccxt_hwmon_ops,
-	.info = ccxt_info,
+static const struct attribute_group *ccxt_groups[] = {
+	&ccxt_group,
+	&ccxt_curve_group,
+	NULL
 };
 
 static int firmware_show(struct seq_file *seqf, void *unused)
@@ -748,6 +2993,123 @@ static int bootloader_show(struct seq_file *seqf, void *unused)
 
 DEFINE_SHOW_ATTRIBUTE(bootloader);
 
+static const char *const cmd_stat_names[NUM_CMD_STATS] = {
+	[CMD_STAT_SET] = "set",
+	[CMD_STAT_GET] = "get",
+	[CMD_STAT_OPEN] = "open",
+	[CMD_STAT_CLOSE] = "close",
+	[CMD_STAT_READ] = "read",
+	[CMD_STAT_WRITE] = "write",
+	[CMD_STAT_OTHER] = "other",
+};
+
+static const char *const endpoint_stat_names[NUM_ENDPOINT_STATS] = {
+	[ENDPOINT_STAT_FAN_STATE] = "fan_state",
+	[ENDPOINT_STAT_FAN_PWM] = "fan_pwm",
+	[ENDPOINT_STAT_GET_FANS] = "get_fans",
+	[ENDPOINT_STAT_GET_TEMPERATURES] = "get_temperatures",
+	[ENDPOINT_STAT_OTHER] = "other",
+};
+
+static void stats_show_entries(struct seq_file *seqf, const char *title,
+			const struct ccxt_stats_entry *entries,
+			const char *const *names, int count)
+{
+	int i, j;
+
+	seq_printf(seqf,
+		"%-17s %10s %10s %10s %10s %10s %10s %10s %10s\n", title,
+		"ok", "timeout", "proto", "unsupp", "inval", "nodata", "io",
+		"other");
+	for (i = 0; i < count; i++) {
+		seq_printf(seqf, "%-17s", names[i]);
+		for (j = 0; j < NUM_RESULT_STATS; j++)
+			seq_printf(seqf, " %10llu", entries[i].results[j]);
+		seq_putc(seqf, '\n');
+	}
+
+	/* bucket n holds latencies in [2^(n-1), 2^n) us */
+	seq_printf(seqf, "\n%-17s latency histogram (us upper bound: count)\n",
+		title);
+	for (i = 0; i < count; i++) {
+		seq_printf(seqf, "%-17s", names[i]);
+		for (j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+			if (!entries[i].latency[j])
+				continue;
+			if (j == NUM_LATENCY_BUCKETS - 1)
+				seq_printf(seqf, " inf:%llu",
+					entries[i].latency[j]);
+			else
+				seq_printf(seqf, " %lu:%llu", BIT(j),
+					entries[i].latency[j]);
+		}
+		seq_putc(seqf, '\n');
+	}
+}
+
+static int stats_show(struct seq_file *seqf, void *unused)
+{
+	struct ccxt_device *ccxt = seqf->private;
+
+	mutex_lock(&ccxt->mutex);
+
+	stats_show_entries(seqf, "command", ccxt->cmd_stats, cmd_stat_names,
+			NUM_CMD_STATS);
+	seq_putc(seqf, '\n');
+	stats_show_entries(seqf, "endpoint", ccxt->endpoint_stats,
+			endpoint_stat_names, NUM_ENDPOINT_STATS);
+
+	seq_printf(seqf, "\nsrtt_us %u rttvar_us %u timeout_us %lu\n",
+		ccxt->srtt_us, ccxt->rttvar_us, request_timeout_us(ccxt));
+
+	spin_lock_bh(&ccxt->wait_input_report_lock);
+	seq_printf(seqf, "foreign_reports %llu\n", ccxt->foreign_reports);
+	spin_unlock_bh(&ccxt->wait_input_report_lock);
+
+	seq_printf(seqf, "requests %llu batches %llu\n",
+		READ_ONCE(ccxt->queue_stats.requests),
+		READ_ONCE(ccxt->queue_stats.batches));
+
+	seq_printf(seqf, "pwm written %llu unchanged %llu deferred %llu\n",
+		ccxt->pwm_stats.written, ccxt->pwm_stats.unchanged,
+		ccxt->pwm_stats.deferred);
+
+	seq_printf(seqf, "breaker %s failures %u retries %llu trips %llu short_circuits %llu\n",
+		ccxt->breaker.state == BREAKER_CLOSED ? "closed" :
+		ccxt->breaker.state == BREAKER_OPEN ? "open" : "half-open",
+		ccxt->breaker.failures, ccxt->breaker.retries,
+		ccxt->breaker.trips, ccxt->breaker.short_circuits);
+
+	mutex_unlock(&ccxt->mutex);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/* all sensor values as struct ccxt_sample, refreshed by a sweep if stale */
+static ssize_t sample_read(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	struct ccxt_device *ccxt = file->private_data;
+	struct ccxt_sample sample;
+
+	if (!*ppos)
+		ccxt_sweep(ccxt);
+
+	fill_sample(ccxt, &sample);
+
+	return simple_read_from_buffer(buf, count, ppos, &sample,
+				sizeof(sample));
+}
+
+static const struct file_operations sample_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = sample_read,
+	.llseek = default_llseek,
+};
+
 static void ccxt_debugfs_init(struct ccxt_device *ccxt)
 {
 	char name[32];
@@ -766,38 +3128,360 @@ static void ccxt_debugfs_init(struct ccxt_device *ccxt)
 	if (!ret)
 		debugfs_create_file("bootloader_version", 0444, ccxt->debugfs,
 			ccxt, &bootloader_fops);
+
+	debugfs_create_file("stats", 0444, ccxt->debugfs, ccxt, &stats_fops);
+	debugfs_create_file_size("sample", 0444, ccxt->debugfs, ccxt,
+				&sample_fops, sizeof(struct ccxt_sample));
 }
 
-static int ccxt_probe(struct hid_device *hdev, const struct hid_device_id *id)
+static void ccxt_chardev_release_kref(struct kref *kref)
+{
+	kfree(container_of(kref, struct ccxt_chardev, kref));
+}
+
+static int ccxt_chardev_open(struct inode *inode, struct file *file)
+{
+	/* misc_open() keeps the device from being deregistered meanwhile */
+	struct ccxt_chardev *chardev =
+		container_of(file->private_data, struct ccxt_chardev, misc);
+	struct ccxt_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	kref_get(&chardev->kref);
+	reader->chardev = chardev;
+	file->private_data = reader;
+
+	return stream_open(inode, file);
+}
+
+static int ccxt_chardev_release(struct inode *inode, struct file *file)
+{
+	struct ccxt_reader *reader = file->private_data;
+
+	kref_put(&reader->chardev->kref, ccxt_chardev_release_kref);
+	kfree(reader);
+
+	return 0;
+}
+
+/* whether a snapshot the reader hasn't seen yet was published */
+static bool ccxt_chardev_new_sample(const struct ccxt_reader *reader)
 {
+	return READ_ONCE(reader->chardev->seq) != reader->seq ||
+	       !READ_ONCE(reader->chardev->ccxt);
+}
+
+/* without the poller every read returns a fresh sweep right away */
+static bool ccxt_chardev_readable(const struct ccxt_reader *reader)
+{
+	return !READ_ONCE(reader->chardev->polling) ||
+	       ccxt_chardev_new_sample(reader);
+}
+
+/*
+ * Every read returns one struct ccxt_sample. While the poller runs, reads
+ * wait for a snapshot newer than the last one returned, otherwise stale
+ * values are refreshed first like with the sample debugfs file.
+ */
+static ssize_t ccxt_chardev_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct ccxt_reader *reader = file->private_data;
+	struct ccxt_chardev *chardev = reader->chardev;
+	struct ccxt_sample sample;
 	struct ccxt_device *ccxt;
 	int ret;
 
-	ccxt = devm_kzalloc(&hdev->dev, sizeof(*ccxt), GFP_KERNEL);
-	if (!ccxt)
-		return -ENOMEM;
+	if (count < sizeof(sample))
+		return -EINVAL;
 
-	ccxt->cmd_buffer =
-		devm_kmalloc(&hdev->dev, OUT_BUFFER_SIZE, GFP_KERNEL);
-	if (!ccxt->cmd_buffer)
-		return -ENOMEM;
+	for (;;) {
+		mutex_lock(&chardev->lock);
+
+		ccxt = chardev->ccxt;
+		if (!ccxt) {
+			mutex_unlock(&chardev->lock);
+			return -ENODEV;
+		}
+
+		if (!READ_ONCE(ccxt->poll_interval_ms) ||
+		    ccxt_chardev_new_sample(reader))
+			break;
+
+		mutex_unlock(&chardev->lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(chardev->wait,
+					ccxt_chardev_readable(reader));
+		if (ret)
+			return ret;
+	}
+
+	if (!READ_ONCE(ccxt->poll_interval_ms))
+		ccxt_sweep(ccxt);
+	fill_sample(ccxt, &sample);
+
+	mutex_unlock(&chardev->lock);
+
+	reader->seq = sample.seq;
+
+	if (copy_to_user(buf, &sample, sizeof(sample)))
+		return -EFAULT;
+
+	return sizeof(sample);
+}
+
+static __poll_t ccxt_chardev_poll(struct file *file, poll_table *wait)
+{
+	struct ccxt_reader *reader = file->private_data;
+
+	poll_wait(file, &reader->chardev->wait, wait);
+
+	if (!READ_ONCE(reader->chardev->ccxt))
+		return EPOLLHUP | EPOLLERR;
+	if (ccxt_chardev_readable(reader))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations ccxt_chardev_fops = {
+	.owner = THIS_MODULE,
+	.open = ccxt_chardev_open,
+	.release = ccxt_chardev_release,
+	.read = ccxt_chardev_read,
+	.poll = ccxt_chardev_poll,
+};
+
+/* register /dev/corsairccxt-<hid device>, the driver works without it */
+static void ccxt_chardev_init(struct ccxt_device *ccxt)
+{
+	struct ccxt_chardev *chardev;
+	int ret;
+
+	chardev = kzalloc(sizeof(*chardev), GFP_KERNEL);
+	if (!chardev)
+		return;
+
+	kref_init(&chardev->kref);
+	mutex_init(&chardev->lock);
+	init_waitqueue_head(&chardev->wait);
+	chardev->ccxt = ccxt;
+
+	scnprintf(chardev->name, sizeof(chardev->name), "corsairccxt-%s",
+		dev_name(&ccxt->hdev->dev));
+	chardev->misc.minor = MISC_DYNAMIC_MINOR;
+	chardev->misc.name = chardev->name;
+	chardev->misc.fops = &ccxt_chardev_fops;
+	chardev->misc.parent = &ccxt->hdev->dev;
+
+	mutex_lock(&ccxt->mutex);
+	chardev->seq = rcu_dereference_protected(ccxt->snapshot,
+					lockdep_is_held(&ccxt->mutex))->seq;
+	chardev->polling = READ_ONCE(ccxt->poll_interval_ms);
+	ccxt->chardev = chardev;
+	mutex_unlock(&ccxt->mutex);
+
+	ret = misc_register(&chardev->misc);
+	if (ret) {
+		hid_warn(ccxt->hdev, "failed to register character device: %d\n",
+			ret);
+		mutex_lock(&ccxt->mutex);
+		ccxt->chardev = NULL;
+		mutex_unlock(&ccxt->mutex);
+		kref_put(&chardev->kref, ccxt_chardev_release_kref);
+	}
+}
+
+static void ccxt_chardev_remove(struct ccxt_device *ccxt)
+{
+	struct ccxt_chardev *chardev = ccxt->chardev;
+
+	if (!chardev)
+		return;
+
+	/* no new files after this, open ones see the device vanish */
+	misc_deregister(&chardev->misc);
+
+	mutex_lock(&chardev->lock);
+	WRITE_ONCE(chardev->ccxt, NULL);
+	mutex_unlock(&chardev->lock);
+	wake_up_interruptible(&chardev->wait);
+
+	mutex_lock(&ccxt->mutex);
+	ccxt->chardev = NULL;
+	mutex_unlock(&ccxt->mutex);
+
+	kref_put(&chardev->kref, ccxt_chardev_release_kref);
+}
+
+/* 30% at 30 degree Celsius up to full speed at 60 */
+static const struct ccxt_curve ccxt_default_curve = {
+	.temp = { 30000, 40000, 50000, 60000 },
+	.pwm = { 77, 128, 191, 255 },
+};
+
+/*
+ * re-detect the connected fans and sensors. hwmon computes attribute
+ * visibility once, so it is registered again if anything changed.
+ */
+static void ccxt_rescan_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(to_delayed_work(work), struct ccxt_device,
+			rescan_work);
+	DECLARE_BITMAP(fan_cnct, NUM_FANS);
+	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
+	struct device *hwmon_dev;
+	unsigned int interval;
+	int ret;
+
+	bitmap_copy(fan_cnct, ccxt->fan_cnct, NUM_FANS);
+	bitmap_copy(temp_cnct, ccxt->temp_cnct, NUM_TEMP_SENSORS);
+
+	/* the snapshots published while rescanning don't hint at another rescan */
+	mutex_lock(&ccxt->mutex);
+	ccxt->rescanning = true;
+	ccxt->rescan_time = jiffies;
+	mutex_unlock(&ccxt->mutex);
+
+	ret = get_fan_cnct(ccxt);
+	if (!ret)
+		ret = get_temp_cnct(ccxt);
+
+	mutex_lock(&ccxt->mutex);
+	ccxt->rescanning = false;
+	mutex_unlock(&ccxt->mutex);
+
+	if (ret) {
+		hid_warn(ccxt->hdev, "failed to rescan channels: %d\n", ret);
+		goto out_reschedule;
+	}
+
+	if (bitmap_equal(fan_cnct, ccxt->fan_cnct, NUM_FANS) &&
+	    bitmap_equal(temp_cnct, ccxt->temp_cnct, NUM_TEMP_SENSORS))
+		goto out_reschedule;
+
+	hid_info(ccxt->hdev, "connected channels changed, fans %*pb sensors %*pb\n",
+		NUM_FANS, ccxt->fan_cnct, NUM_TEMP_SENSORS, ccxt->temp_cnct);
+
+	/* the old device may have readers waiting for the mutex */
+	mutex_lock(&ccxt->mutex);
+	hwmon_dev = ccxt->hwmon_dev;
+	ccxt->hwmon_dev = NULL;
+	mutex_unlock(&ccxt->mutex);
+	cancel_work_sync(&ccxt->alarm_work);
+	if (hwmon_dev)
+		hwmon_device_unregister(hwmon_dev);
+
+	hwmon_dev = hwmon_device_register_with_info(
+		&ccxt->hdev->dev, "corsairccxt", ccxt, &ccxt_chip_info,
+		ccxt_groups);
+	if (IS_ERR(hwmon_dev)) {
+		hid_err(ccxt->hdev, "failed to register hwmon device: %ld\n",
+			PTR_ERR(hwmon_dev));
+		return;
+	}
+
+	mutex_lock(&ccxt->mutex);
+	ccxt->hwmon_dev = hwmon_dev;
+	mutex_unlock(&ccxt->mutex);
+
+out_reschedule:
+	interval = READ_ONCE(rescan_interval_ms);
+	if (!interval)
+		return;
+
+	mutex_lock(&ccxt->mutex);
+	schedule_rescan(ccxt, msecs_to_jiffies(interval));
+	mutex_unlock(&ccxt->mutex);
+}
+
+/*
+ * Talking to the device for the first time takes several round trips, so it
+ * is done after probe has returned. Channels are only known afterwards and
+ * hwmon gets registered once they are.
+ */
+static void ccxt_setup_work(struct work_struct *work)
+{
+	struct ccxt_device *ccxt =
+		container_of(work, struct ccxt_device, setup_work);
+	struct device *hwmon_dev;
+	int ret;
+
+	/* required to be able to speak to the controller */
+	ret = set_software_mode(ccxt);
+	if (ret)
+		goto out_err;
+
+	/* fan and temp connection status only updates when the device is powered on */
+	ret = get_fan_cnct(ccxt);
+	if (ret)
+		goto out_err;
+
+	/* the open session of the previous endpoint is closed along the way */
+	ret = get_temp_cnct(ccxt);
+	if (ret)
+		goto out_err;
+
+	ccxt_debugfs_init(ccxt);
+
+	hwmon_dev = hwmon_device_register_with_info(
+		&ccxt->hdev->dev, "corsairccxt", ccxt, &ccxt_chip_info,
+		ccxt_groups);
+	if (IS_ERR(hwmon_dev)) {
+		ret = PTR_ERR(hwmon_dev);
+		goto out_err;
+	}
+
+	/* alarm changes are reported from here on */
+	mutex_lock(&ccxt->mutex);
+	ccxt->hwmon_dev = hwmon_dev;
+	mutex_unlock(&ccxt->mutex);
+
+	ccxt_chardev_init(ccxt);
+
+	if (ccxt->poll_interval_ms)
+		queue_delayed_work(ccxt->wq, &ccxt->poll_work, 0);
+
+	if (READ_ONCE(rescan_interval_ms)) {
+		mutex_lock(&ccxt->mutex);
+		schedule_rescan(ccxt, msecs_to_jiffies(rescan_interval_ms));
+		mutex_unlock(&ccxt->mutex);
+	}
+
+	return;
+
+out_err:
+	hid_err(ccxt->hdev, "failed to set up device: %d\n", ret);
+}
 
-	ccxt->buffer = devm_kmalloc(&hdev->dev, IN_BUFFER_SIZE, GFP_KERNEL);
-	if (!ccxt->buffer)
+static int ccxt_probe(struct hid_device *hdev, const struct hid_device_id *id)
+{
+	struct ccxt_device *ccxt;
+	int ret, i;
+
+	ccxt = devm_kzalloc(&hdev->dev, sizeof(*ccxt), GFP_KERNEL);
+	if (!ccxt)
 		return -ENOMEM;
 
-	ccxt->data_buffer =
-		devm_kmalloc(&hdev->dev, IN_BUFFER_SIZE, GFP_KERNEL);
-	if (!ccxt->data_buffer)
+	ccxt->wq = alloc_ordered_workqueue("corsairccxt-%s", 0,
+					dev_name(&hdev->dev));
+	if (!ccxt->wq)
 		return -ENOMEM;
 
 	ret = hid_parse(hdev);
 	if (ret)
-		return ret;
+		goto out_destroy_wq;
 
 	ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
 	if (ret)
-		return ret;
+		goto out_destroy_wq;
 
 	ret = hid_hw_open(hdev);
 	if (ret)
@@ -806,54 +3490,188 @@ static int ccxt_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	ccxt->hdev = hdev;
 	hid_set_drvdata(hdev, ccxt);
 
+	ccxt->cache_time_ms = cache_time_ms;
+	ccxt->poll_interval_ms = poll_interval_ms;
+	ccxt_proto_session_init(&ccxt->session, &ccxt_transport, ccxt,
+			ccxt->cmd_buffer);
+	spin_lock_init(&ccxt->queue_lock);
+	INIT_LIST_HEAD(&ccxt->queue);
+	INIT_WORK(&ccxt->dispatch_work, ccxt_dispatch_work);
+	RCU_INIT_POINTER(ccxt->snapshot, &ccxt->snapshot_buf[0]);
+	INIT_DELAYED_WORK(&ccxt->poll_work, ccxt_poll_work);
+	INIT_WORK(&ccxt->alarm_work, ccxt_alarm_work);
+	ccxt->pwm_flush_delay_ms = pwm_flush_delay_ms;
+	ccxt->pwm_min_interval_ms = pwm_min_interval_ms;
+	spin_lock_init(&ccxt->pwm_pending_lock);
+	INIT_DELAYED_WORK(&ccxt->pwm_flush_work, ccxt_pwm_flush_work);
+
+	mutex_init(&ccxt->control_lock);
+	ccxt->curve_temp_hyst = CURVE_TEMP_HYST;
+	for (i = 0; i < NUM_FANS; i++) {
+		ccxt->fan_mode[i] = FAN_MODE_MANUAL;
+		ccxt->curve_temp_channels[i] = BIT(0);
+		ccxt->control_pwm[i] = -1;
+		ccxt->target_acc[i] = -1;
+		ccxt->target[i] = -ENODATA;
+		ccxt->curve[i] = ccxt_default_curve;
+	}
+	INIT_DELAYED_WORK(&ccxt->control_work, ccxt_control_work);
+
 	mutex_init(&ccxt->mutex);
 	spin_lock_init(&ccxt->wait_input_report_lock);
 	init_completion(&ccxt->wait_input_report);
 
-	hid_device_io_start(hdev);
-
-	/* required to be able to speak to the controller */
-	ret = set_software_mode(ccxt);
-	if (ret)
-		goto out_hw_close;
-
-	/* fan and temp connection status only updates when the device is powered on */
-	ret = get_fan_cnct(ccxt);
-	if (ret)
-		goto out_hw_close;
-
-	ret = get_temp_cnct(ccxt);
-	/*if (ret)
-		goto out_hw_close;*/
+	INIT_WORK(&ccxt->setup_work, ccxt_setup_work);
+	INIT_DELAYED_WORK(&ccxt->rescan_work, ccxt_rescan_work);
+	ccxt->rescan_time = jiffies;
 
-	ccxt_debugfs_init(ccxt);
+	hid_device_io_start(hdev);
 
-	ccxt->hwmon_dev = hwmon_device_register_with_info(
-		&hdev->dev, "corsairccxt", ccxt, &ccxt_chip_info, NULL);
-	if (IS_ERR(ccxt->hwmon_dev)) {
-		ret = PTR_ERR(ccxt->hwmon_dev);
-		goto out_hw_close;
-	}
+	schedule_work(&ccxt->setup_work);
 
 	return 0;
 
-out_hw_close:
-	hid_hw_close(hdev);
 out_hw_stop:
 	hid_hw_stop(hdev);
+out_destroy_wq:
+	destroy_workqueue(ccxt->wq);
 	return ret;
 }
 
 static void ccxt_remove(struct hid_device *hdev)
 {
 	struct ccxt_device *ccxt = hid_get_drvdata(hdev);
+	struct ccxt_snapshot *snap;
+	struct device *hwmon_dev;
+
+	cancel_work_sync(&ccxt->setup_work);
 
+	mutex_lock(&ccxt->mutex);
+	ccxt->removing = true;
+	mutex_unlock(&ccxt->mutex);
+	/* a running rescan may still swap the hwmon device */
+	cancel_delayed_work_sync(&ccxt->rescan_work);
+
+	ccxt_chardev_remove(ccxt);
 	debugfs_remove_recursive(ccxt->debugfs);
-	hwmon_device_unregister(ccxt->hwmon_dev);
+
+	mutex_lock(&ccxt->mutex);
+	hwmon_dev = ccxt->hwmon_dev;
+	ccxt->hwmon_dev = NULL;
+	mutex_unlock(&ccxt->mutex);
+	cancel_work_sync(&ccxt->alarm_work);
+	if (hwmon_dev)
+		hwmon_device_unregister(hwmon_dev);
+	cancel_delayed_work_sync(&ccxt->poll_work);
+	cancel_delayed_work_sync(&ccxt->control_work);
+	cancel_delayed_work_sync(&ccxt->pwm_flush_work);
+	/* complete what is left in the queue */
+	flush_work(&ccxt->dispatch_work);
 	set_hardware_mode(ccxt);
+	destroy_workqueue(ccxt->wq);
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+
+	/* the published snapshot may be a copy from snapshot_begin() */
+	snap = rcu_dereference_protected(ccxt->snapshot, true);
+	if (snapshot_buf_index(ccxt, snap) < 0)
+		kfree_rcu(snap, rcu);
+}
+
+#ifdef CONFIG_PM
+static int ccxt_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct ccxt_device *ccxt = hid_get_drvdata(hdev);
+
+	/* the device state to restore has to be complete */
+	flush_work(&ccxt->setup_work);
+	cancel_delayed_work_sync(&ccxt->rescan_work);
+	cancel_delayed_work_sync(&ccxt->poll_work);
+	cancel_delayed_work_sync(&ccxt->control_work);
+	/* send pwm values still waiting, they are part of what gets restored */
+	flush_delayed_work(&ccxt->pwm_flush_work);
+	flush_work(&ccxt->dispatch_work);
+
+	return 0;
+}
+
+/*
+ * The device comes back in hardware mode with its endpoints closed. Restore
+ * the mode and replay all duty cycles in one write, then let fan control and
+ * the poller pick up where they left off.
+ */
+static int ccxt_restore(struct ccxt_device *ccxt)
+{
+	struct ccxt_snapshot *snap;
+	bool hardware, registered;
+	unsigned int interval;
+	int ret = 0, channel;
+
+	mutex_lock(&ccxt->mutex);
+	hardware = ccxt->hardware_mode;
+	registered = ccxt->hwmon_dev;
+	ccxt->session.open_endpoint = ENDPOINT_UNKNOWN;
+
+	/* values from before the suspend are stale however old they look */
+	snap = snapshot_begin(ccxt);
+	snap->valid = 0;
+	snap->stale = 0;
+	memset(snap->err, 0, sizeof(snap->err));
+	snapshot_publish(ccxt, snap);
+
+	/* give the device a fresh start */
+	ccxt->pwm_synced = 0;
+	ccxt->breaker.state = BREAKER_CLOSED;
+	ccxt->breaker.failures = 0;
+	mutex_unlock(&ccxt->mutex);
+
+	if (!hardware) {
+		ret = set_software_mode(ccxt);
+		if (ret)
+			goto out_err;
+
+		mutex_lock(&ccxt->mutex);
+		ret = write_pwm(ccxt, ccxt->applied_duty,
+				ccxt->applied_channels);
+		mutex_unlock(&ccxt->mutex);
+		if (ret)
+			goto out_err;
+	}
+
+	/* reapply fan curves and targets */
+	mutex_lock(&ccxt->control_lock);
+	for (channel = 0; channel < NUM_FANS; channel++)
+		ccxt->control_pwm[channel] = -1;
+	mutex_unlock(&ccxt->control_lock);
+	mod_delayed_work(system_wq, &ccxt->control_work, 0);
+
+	if (registered && READ_ONCE(ccxt->poll_interval_ms))
+		queue_delayed_work(ccxt->wq, &ccxt->poll_work, 0);
+
+	interval = READ_ONCE(rescan_interval_ms);
+	if (interval) {
+		mutex_lock(&ccxt->mutex);
+		schedule_rescan(ccxt, msecs_to_jiffies(interval));
+		mutex_unlock(&ccxt->mutex);
+	}
+
+	return 0;
+
+out_err:
+	hid_err(ccxt->hdev, "failed to restore state after resume: %d\n", ret);
+	return ret;
+}
+
+static int ccxt_resume(struct hid_device *hdev)
+{
+	return ccxt_restore(hid_get_drvdata(hdev));
+}
+
+static int ccxt_reset_resume(struct hid_device *hdev)
+{
+	return ccxt_restore(hid_get_drvdata(hdev));
 }
+#endif
 
 static const struct hid_device_id ccxt_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR,
@@ -867,6 +3685,15 @@ static struct hid_driver ccxt_driver = {
 	.probe = ccxt_probe,
 	.remove = ccxt_remove,
 	.raw_event = ccxt_raw_event,
+#ifdef CONFIG_PM
+	.suspend = ccxt_suspend,
+	.resume = ccxt_resume,
+	.reset_resume = ccxt_reset_resume,
+#endif
+	.driver = {
+		/* setup is deferred anyway, don't hold up other probes either */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 
 MODULE_DEVICE_TABLE(hid, ccxt_devices);
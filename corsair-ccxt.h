@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * corsair-ccxt.h - Userspace interface of the Corsair Commander Core XT driver
+ * Copyright (C) 2025 Max Rumpf <kernel@maxr1998.de>
+ */
+
+#ifndef _CORSAIR_CCXT_H
+#define _CORSAIR_CCXT_H
+
+#include <linux/types.h>
+
+#define CCXT_SAMPLE_VERSION 1
+
+#define CCXT_SAMPLE_FANS 6
+#define CCXT_SAMPLE_TEMP_SENSORS 2
+
+/* bits in ccxt_sample.valid */
+#define CCXT_SAMPLE_VALID_RPM (1 << 0)
+#define CCXT_SAMPLE_VALID_PWM (1 << 1)
+#define CCXT_SAMPLE_VALID_TEMP (1 << 2)
+/* values kept from before the device stopped responding */
+#define CCXT_SAMPLE_STALE_RPM (1 << 8)
+#define CCXT_SAMPLE_STALE_PWM (1 << 9)
+#define CCXT_SAMPLE_STALE_TEMP (1 << 10)
+
+/**
+ * struct ccxt_sample - all sensor values of one controller, as returned by
+ * read() on /dev/corsairccxt-* and the sample debugfs file
+ * @version: CCXT_SAMPLE_VERSION
+ * @size: size of this struct in bytes
+ * @seq: incremented whenever the driver publishes new values
+ * @timestamp_ns: CLOCK_MONOTONIC time the values were published
+ * @valid: CCXT_SAMPLE_VALID_* bits of the values that could be read,
+ *	CCXT_SAMPLE_STALE_* bits of the values that are older than the last read
+ * @num_fans: number of fan channels reported by the device
+ * @num_temp_sensors: number of temperature channels reported by the device
+ * @fan_cnct: bitmask of fan channels with a connected fan
+ * @temp_cnct: bitmask of temperature channels with a connected sensor
+ * @rpm: fan speed in rpm
+ * @pwm: fan duty cycle, 0-255
+ * @temp: temperature in millidegree Celsius
+ */
+struct ccxt_sample {
+	__u16 version;
+	__u16 size;
+	__u32 valid;
+	__u64 seq;
+	__u64 timestamp_ns;
+	__u8 num_fans;
+	__u8 num_temp_sensors;
+	__u8 fan_cnct;
+	__u8 temp_cnct;
+	__s32 rpm[CCXT_SAMPLE_FANS];
+	__s32 pwm[CCXT_SAMPLE_FANS];
+	__s32 temp[CCXT_SAMPLE_TEMP_SENSORS];
+	__u32 reserved;
+};
+
+#endif /* _CORSAIR_CCXT_H */
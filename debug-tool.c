@@ -9,14 +9,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <hidapi/hidapi.h>
 #include "polyfills.h"
-
-/* Polyfills */
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef short s16;
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#include "corsair-ccxt.h"
+#include "corsair-ccxt-proto.h"
 
 #define USB_VENDOR_ID_CORSAIR 0x1b1c
 #define USB_PRODUCT_ID_CORSAIR_COMMANDER_CORE_XT 0x0c2a
@@ -25,60 +26,21 @@ typedef short s16;
  * The maximum number of fans and temperature sensors supported by the driver.
  */
 #define NUM_FANS 6
-#define NUM_TEMP_SENSORS 4
+#define NUM_TEMP_SENSORS 2
 
 #define REQ_TIMEOUT 300
-#define OUT_BUFFER_SIZE 385
-#define IN_BUFFER_SIZE 384
 #define LABEL_LENGTH 11
 
-#define CMD_HEADER_SIZE 2
-#define WRITE_DATA_HEADER_SIZE 4
-
-#define FAN_CNT_INDEX 5
-#define FAN_DATA_OFFSET 6
-
-#define FAN_STATE_OK 0x07
-
-#define prepare_cmd_safe(ccxt, cmd) \
-	({ prepare_cmd(ccxt, cmd, ARRAY_SIZE(cmd)); })
-
-#define prepare_endpoint_cmd_safe(ccxt, cmd, endpoint) \
-	({ prepare_endpoint_cmd(ccxt, cmd, ARRAY_SIZE(cmd), endpoint); })
-
-/**
- * Returns the firmware version as four bytes (patch version uses two bytes)
- */
-static const u8 cmd_get_firmware[] = { 0x02, 0x13 };
-static const u8 cmd_hardware_mode[] = { 0x01, 0x03, 0x00, 0x01 };
-static const u8 cmd_software_mode[] = { 0x01, 0x03, 0x00, 0x02 };
-static const u8 cmd_open_endpoint[] = { 0x0d, 0x01 };
-static const u8 cmd_close_endpoint[] = { 0x05, 0x01, 0x01 };
-static const u8 cmd_write[] = { 0x06, 0x01 };
-static const u8 cmd_read[] = { 0x08, 0x01 };
-
-/**
- * Endpoint to query the fan speed of all connected fans.
- */
-static const u8 endpoint_fan_state = 0x17;
-
-/**
- * Endpoint to set the fan PWM of one or multiple fans by id.
- */
-static const u8 endpoint_fan_pwm = 0x18;
-
-/**
- * Endpoint to query the number of total supported fans and the connection state for each.
- */
-static const u8 endpoint_get_fans = 0x1a;
+/* default number of iterations per benchmark case */
+#define BENCH_ITERATIONS 100
 
-/**
- * Endpoint to query the number of total supported temperature sensors
- * and the temperature reported by each connected sensor.
- */
-static const u8 endpoint_get_temperatures = 0x21;
+/* default number of record slots in the ring file (~5.5 MiB) */
+#define RECORD_CAPACITY 65536
+#define RECORD_MAGIC "CCXTRING"
+#define RECORD_VERSION 1
 
-static const u8 data_type_set_speed[] = { 0x07, 0x00 };
+/* fans connected to the simulated controller */
+#define MOCK_FAN_CNCT 0x07
 
 struct firmware_version {
 	u8 major;
@@ -86,8 +48,25 @@ struct firmware_version {
 	u16 patch;
 };
 
+/* latencies of a benchmark case in nanoseconds */
+struct latency_log {
+	long long *ns;
+	size_t len;
+	size_t cap;
+};
+
+/* state of the simulated controller */
+struct ccxt_mock {
+	long long latency_ns; /* added to every command */
+	int hardware_mode;
+	int open_endpoint; /* ENDPOINT_NONE or the endpoint opened last */
+	u8 duty[NUM_FANS];
+};
+
 struct ccxt_device {
 	hid_device *hdev;
+	struct ccxt_mock *mock; /* used instead of hdev if set */
+	struct ccxt_proto_session session;
 	u8 *cmd_buffer;
 	u8 *buffer;
 	u8 *data_buffer;
@@ -99,6 +78,7 @@ struct ccxt_device {
 	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
 	DECLARE_BITMAP(fan_cnct, NUM_FANS);
 	char fan_label[NUM_FANS][LABEL_LENGTH];
+	struct latency_log *cmd_log; /* records every send_usb if set */
 	void *mutex;
 };
 
@@ -126,54 +106,199 @@ void print_buffer(const u8 *buffer, const int length)
 	printf("\n--------------------\n");
 }
 
-/* prepare ccxt->cmd_buffer with command and return used size */
-static int prepare_cmd(struct ccxt_device *ccxt, const u8 *command,
-			size_t command_len)
+static long long now_ns(void)
 {
-	memset(ccxt->cmd_buffer, 0x00, OUT_BUFFER_SIZE);
-	ccxt->cmd_buffer[0] = 0x00;
-	ccxt->cmd_buffer[1] = 0x08;
-	memcpy(ccxt->cmd_buffer + CMD_HEADER_SIZE, command, command_len);
+	struct timespec ts;
 
-	return CMD_HEADER_SIZE + command_len;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-/* prepare ccxt->cmd_buffer with command and single-valued endpoint and return used size */
-static int prepare_endpoint_cmd(struct ccxt_device *ccxt, const u8 *command,
-				size_t command_len, u8 endpoint)
+static void log_latency(struct latency_log *log, long long ns)
 {
-	int ret = prepare_cmd(ccxt, command, command_len);
-	ccxt->cmd_buffer[ret] = endpoint;
-	return ret + 1;
+	if (log && log->len < log->cap)
+		log->ns[log->len++] = ns;
 }
 
-static int send_usb(struct ccxt_device *ccp)
+/* answer the temperature endpoint: sensor 1 at 31.5 degree Celsius, sensor 2 disconnected */
+static void mock_temperatures(u8 *buf)
+{
+	buf[TEMP_CNT_INDEX] = NUM_TEMP_SENSORS;
+	buf[TEMP_DATA_OFFSET] = TEMP_STATE_OK;
+	buf[TEMP_DATA_OFFSET + 1] = 315 & 0xff;
+	buf[TEMP_DATA_OFFSET + 2] = 315 >> 8;
+	buf[TEMP_DATA_OFFSET + TEMP_DATA_SIZE] = 0x01;
+}
+
+static void mock_read(struct ccxt_mock *mock, u8 endpoint, u8 *buf)
+{
+	int channel, rpm;
+
+	if (endpoint == endpoint_get_temperatures) {
+		mock_temperatures(buf);
+		return;
+	}
+
+	buf[FAN_CNT_INDEX] = NUM_FANS;
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (endpoint == endpoint_get_fans) {
+			buf[FAN_DATA_OFFSET + channel] =
+				MOCK_FAN_CNCT & (1 << channel) ? FAN_STATE_OK :
+								 0x01;
+		} else if (endpoint == endpoint_fan_pwm) {
+			buf[FAN_DATA_OFFSET + channel * FAN_PWM_DATA_SIZE] =
+				channel;
+			buf[FAN_DATA_OFFSET + channel * FAN_PWM_DATA_SIZE + 2] =
+				mock->duty[channel];
+		} else if (endpoint == endpoint_fan_state) {
+			/* connected fans spin from 300 to 1800 rpm */
+			rpm = MOCK_FAN_CNCT & (1 << channel) ?
+				      300 + mock->duty[channel] * 15 :
+				      0;
+			buf[FAN_DATA_OFFSET + channel * 2] = rpm & 0xff;
+			buf[FAN_DATA_OFFSET + channel * 2 + 1] = rpm >> 8;
+		}
+	}
+}
+
+/* apply a write of data_type_set_speed to endpoint_fan_pwm */
+static u8 mock_write(struct ccxt_mock *mock, const u8 *cmd)
+{
+	const u8 *data = cmd + ARRAY_SIZE(cmd_write) + WRITE_DATA_HEADER_SIZE;
+	const u8 *entry = data + ARRAY_SIZE(data_type_set_speed) + 1;
+	int i;
+
+	if (mock->open_endpoint != endpoint_fan_pwm ||
+	    memcmp(data, data_type_set_speed, ARRAY_SIZE(data_type_set_speed)))
+		return 0x01;
+
+	for (i = 0; i < data[ARRAY_SIZE(data_type_set_speed)];
+	     i++, entry += FAN_PWM_DATA_SIZE) {
+		if (entry[0] >= NUM_FANS || entry[2] > 100)
+			return 0x10;
+		mock->duty[entry[0]] = entry[2];
+	}
+
+	return 0x00;
+}
+
+/*
+ * Answer the command in ccxt->cmd_buffer like the controller would. Reads
+ * and writes fail unless their endpoint was opened before, so the session
+ * handling is checked along the way.
+ */
+static int mock_transfer(struct ccxt_device *ccxt)
+{
+	struct ccxt_mock *mock = ccxt->mock;
+	const u8 *cmd = ccxt->cmd_buffer + CMD_HEADER_SIZE;
+	u8 *buf = ccxt->buffer;
+	u8 status = 0x00;
+	struct timespec ts = {
+		.tv_sec = mock->latency_ns / 1000000000LL,
+		.tv_nsec = mock->latency_ns % 1000000000LL,
+	};
+
+	if (mock->latency_ns)
+		nanosleep(&ts, NULL);
+
+	memset(buf, 0x00, IN_BUFFER_SIZE);
+	buf[RESPONSE_CMD_INDEX] = cmd[0];
+
+	if (!memcmp(cmd, cmd_get_firmware, ARRAY_SIZE(cmd_get_firmware))) {
+		buf[FW_VERSION_INDEX] = 2;
+		buf[FW_VERSION_INDEX + 1] = 10;
+		buf[FW_VERSION_INDEX + 2] = 219;
+	} else if (!memcmp(cmd, cmd_get_mode, ARRAY_SIZE(cmd_get_mode))) {
+		buf[MODE_INDEX] = mock->hardware_mode ? MODE_HARDWARE :
+							MODE_SOFTWARE;
+	} else if (!memcmp(cmd, cmd_hardware_mode,
+			   ARRAY_SIZE(cmd_hardware_mode))) {
+		mock->hardware_mode = 1;
+	} else if (!memcmp(cmd, cmd_software_mode,
+			   ARRAY_SIZE(cmd_software_mode))) {
+		mock->hardware_mode = 0;
+	} else if (!memcmp(cmd, cmd_open_endpoint,
+			   ARRAY_SIZE(cmd_open_endpoint))) {
+		mock->open_endpoint = cmd[ARRAY_SIZE(cmd_open_endpoint)];
+	} else if (!memcmp(cmd, cmd_close_endpoint,
+			   ARRAY_SIZE(cmd_close_endpoint))) {
+		if (mock->open_endpoint == cmd[ARRAY_SIZE(cmd_close_endpoint)])
+			mock->open_endpoint = ENDPOINT_NONE;
+	} else if (!memcmp(cmd, cmd_read, ARRAY_SIZE(cmd_read))) {
+		if (mock->open_endpoint == cmd[ARRAY_SIZE(cmd_read)])
+			mock_read(mock, cmd[ARRAY_SIZE(cmd_read)], buf);
+		else
+			status = 0x01;
+	} else if (!memcmp(cmd, cmd_write, ARRAY_SIZE(cmd_write))) {
+		status = mock_write(mock, cmd);
+	} else {
+		status = 0x01;
+	}
+
+	buf[0] = status;
+	return IN_BUFFER_SIZE;
+}
+
+static int hid_transfer(struct ccxt_device *ccp)
 {
 	int res;
 
 	res = hid_write(ccp->hdev, ccp->cmd_buffer, OUT_BUFFER_SIZE);
 	if (res == -1) {
 		fprintf(stderr, "Could not write to device\n");
-		return 1;
+		return -EIO;
 	}
 
-	res = hid_read(ccp->hdev, ccp->buffer, IN_BUFFER_SIZE);
+	res = hid_read_timeout(ccp->hdev, ccp->buffer, IN_BUFFER_SIZE,
+			       REQ_TIMEOUT);
 	if (res == -1) {
 		fprintf(stderr, "Could not read from device\n");
-		return -1;
+		return -EIO;
+	}
+	if (res == 0) {
+		fprintf(stderr, "Timed out waiting for device\n");
+		return -ETIMEDOUT;
 	}
+
+	return res;
+}
+
+static int send_usb(struct ccxt_device *ccp)
+{
+	long long start = now_ns();
+	int res;
+
+	res = ccp->mock ? mock_transfer(ccp) : hid_transfer(ccp);
+	if (res < 0)
+		return res;
 	ccp->buffer_recv_size = res;
 
-	return 0;
+	log_latency(ccp->cmd_log, now_ns() - start);
+
+	if (res != IN_BUFFER_SIZE)
+		return -EPROTO;
+
+	return ccxt_proto_errno(ccp->buffer[0]);
+}
+
+static int transport_send(void *priv)
+{
+	return send_usb(priv);
 }
 
+/* hidapi waits for every response, so queued commands are sent right away */
+static const struct ccxt_proto_transport transport = {
+	.queue = transport_send,
+	.send = transport_send,
+};
+
 static int set_software_mode(struct ccxt_device *ccxt)
 {
 	int ret;
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_cmd_safe(ccxt, cmd_software_mode);
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_software_mode);
 	ret = send_usb(ccxt);
 
 	mutex_unlock(&ccxt->mutex);
@@ -187,17 +312,16 @@ static int get_fw_version(struct ccxt_device *ccxt)
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_cmd_safe(ccxt, cmd_get_firmware);
+	ccxt_proto_cmd_safe(ccxt->cmd_buffer, cmd_get_firmware);
 	ret = send_usb(ccxt);
 
 	if (ret) {
 		hid_notice(ccxt->hdev, "failed to read firmware version.\n");
 		goto out_unlock;
 	}
-	ccxt->firmware_ver.major = ccxt->buffer[3];
-	ccxt->firmware_ver.minor = ccxt->buffer[4];
-	ccxt->firmware_ver.patch = (u16)ccxt->buffer[5] | (u16)ccxt->buffer[6]
-				<< 8;
+	ccxt_proto_fw_version(ccxt->buffer, &ccxt->firmware_ver.major,
+			      &ccxt->firmware_ver.minor,
+			      &ccxt->firmware_ver.patch);
 
 out_unlock:
 	mutex_unlock(&ccxt->mutex);
@@ -207,8 +331,6 @@ out_unlock:
 /* read bootloader version */
 static int get_bl_version(struct ccxt_device *ccxt)
 {
-	int ret;
-
 	return -1;
 
 	// TODO: implement bootloader version readout
@@ -223,25 +345,20 @@ static int get_bl_version(struct ccxt_device *ccxt)
 	return 0;*/
 }
 
-/* reads the data from the given endpoint and stores it in data_buffer */
+/*
+ * reads the data from the given endpoint and stores it in data_buffer,
+ * closing and reopening the endpoint around the read
+ */
 static int read_data(struct ccxt_device *ccxt, u8 endpoint)
 {
-	int ret, i;
+	int ret;
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	/* forces a close before the open */
+	ccxt->session.open_endpoint = ENDPOINT_UNKNOWN;
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_open_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
-
-	prepare_endpoint_cmd_safe(ccxt, cmd_read, endpoint);
-	ret = send_usb(ccxt);
+	ret = ccxt_proto_read(&ccxt->session, endpoint);
 	if (ret)
 		goto out_unlock;
 
@@ -249,8 +366,7 @@ static int read_data(struct ccxt_device *ccxt, u8 endpoint)
 	memcpy(ccxt->data_buffer, ccxt->buffer, IN_BUFFER_SIZE);
 	ccxt->data_buffer_recv_size = ccxt->buffer_recv_size;
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
+	ret = ccxt_proto_close(&ccxt->session);
 
 out_unlock:
 	mutex_unlock(&ccxt->mutex);
@@ -262,61 +378,87 @@ static int write_data(struct ccxt_device *ccxt, u8 endpoint,
 			const u8 *data, size_t data_size)
 {
 	int ret;
-	u8 *writer_header_dst, *data_type_dst, *data_dst;
 
 	mutex_lock(&ccxt->mutex);
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
-	if (ret)
-		goto out_unlock;
+	ccxt->session.open_endpoint = ENDPOINT_UNKNOWN;
 
-	prepare_endpoint_cmd_safe(ccxt, cmd_open_endpoint, endpoint);
-	ret = send_usb(ccxt);
+	ret = ccxt_proto_write(&ccxt->session, endpoint, data_type,
+			       data_type_size, data, data_size);
 	if (ret)
 		goto out_unlock;
 
-	ret = prepare_cmd_safe(ccxt, cmd_write);
+	/* copy result to data buffer */
+	memcpy(ccxt->data_buffer, ccxt->buffer, IN_BUFFER_SIZE);
+
+	ret = ccxt_proto_close(&ccxt->session);
+
+out_unlock:
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
 
-	/* compute header offsets */
-	writer_header_dst = ccxt->cmd_buffer + ret;
-	data_type_dst = writer_header_dst + WRITE_DATA_HEADER_SIZE;
-	data_dst = data_type_dst + data_type_size;
+/* like read_data, but leaves the endpoint open for the next access like the driver */
+static int read_session(struct ccxt_device *ccxt, u8 endpoint)
+{
+	int ret;
 
-	writer_header_dst[0] = data_type_size + data_size;
-	memcpy(data_type_dst, data_type, data_type_size);
-	memcpy(data_dst, data, data_size);
+	mutex_lock(&ccxt->mutex);
 
-	ret = send_usb(ccxt);
+	ret = ccxt_proto_read(&ccxt->session, endpoint);
 	if (ret)
 		goto out_unlock;
 
-	/* copy result to data buffer */
 	memcpy(ccxt->data_buffer, ccxt->buffer, IN_BUFFER_SIZE);
-
-	prepare_endpoint_cmd_safe(ccxt, cmd_close_endpoint, endpoint);
-	ret = send_usb(ccxt);
+	ccxt->data_buffer_recv_size = ccxt->buffer_recv_size;
 
 out_unlock:
 	mutex_unlock(&ccxt->mutex);
 	return ret;
 }
 
+/* like write_data, but leaves the endpoint open for the next access like the driver */
+static int write_session(struct ccxt_device *ccxt, u8 endpoint,
+			 const u8 *data_type, size_t data_type_size,
+			 const u8 *data, size_t data_size)
+{
+	int ret;
+
+	mutex_lock(&ccxt->mutex);
+
+	ret = ccxt_proto_write(&ccxt->session, endpoint, data_type,
+			       data_type_size, data, data_size);
+
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
+
+static int close_session(struct ccxt_device *ccxt)
+{
+	int ret;
+
+	mutex_lock(&ccxt->mutex);
+
+	ret = ccxt_proto_close(&ccxt->session);
+
+	mutex_unlock(&ccxt->mutex);
+	return ret;
+}
+
 /* read fan connection status and set labels */
 static int get_fan_cnct(struct ccxt_device *ccxt)
 {
-	int ret, num_fans, channel, state;
+	int ret, num_fans, channel;
 
 	ret = read_data(ccxt, endpoint_get_fans);
 	if (ret)
 		return ret;
 
 	/* The theoretical number of fans this controller supports */
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+	num_fans = ccxt_proto_fan_count(ccxt->data_buffer);
 
 	for (channel = 0; channel < min(num_fans, NUM_FANS); channel++) {
-		state = ccxt->data_buffer[FAN_DATA_OFFSET + channel];
-		if (state != FAN_STATE_OK)
+		if (!ccxt_proto_fan_connected(ccxt->data_buffer, channel))
 			continue;
 
 		set_bit(channel, ccxt->fan_cnct);
@@ -333,49 +475,40 @@ static int get_fan_cnct(struct ccxt_device *ccxt)
 static int get_temp_cnct(struct ccxt_device *ccxt)
 {
 	int ret, num_sensors, channel;
+	long val;
 
 	ret = read_data(ccxt, endpoint_get_temperatures);
 	if (ret)
 		return ret;
 
 	/* The theoretical number of temperature sensors this controller supports */
-	num_sensors = ccxt->data_buffer[FAN_CNT_INDEX];
-
-	for (
-		channel = 0;
-		channel < min(num_sensors, NUM_TEMP_SENSORS);
-		channel++
-	) {
-		/*mode = ccxt->buffer[channel + 1];
-		if (mode == 0)
-			continue;
+	num_sensors = ccxt_proto_temp_count(ccxt->data_buffer);
 
-		set_bit(channel, ccxt->temp_cnct);*/
+	for (channel = 0; channel < min(num_sensors, NUM_TEMP_SENSORS);
+	     channel++) {
+		if (!ccxt_proto_temp(ccxt->data_buffer, channel, &val))
+			set_bit(channel, ccxt->temp_cnct);
 	}
 
-	return -1;
+	return 0;
 }
 
 static int get_fan_rpm(struct ccxt_device *ccxt, int channel, long *val)
 {
-	int ret, num_fans, data_index;
+	int ret, num_fans;
 
 	ret = read_data(ccxt, endpoint_fan_state);
 	if (ret)
 		return ret;
 
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+	num_fans = ccxt_proto_fan_count(ccxt->data_buffer);
 
 	if (channel >= min(num_fans, NUM_FANS)) {
 		hid_notice(ccxt->hdev, "invalid fan channel %d\n", channel);
 		return -EINVAL;
 	}
 
-	/* two bytes per value */
-	data_index = FAN_DATA_OFFSET + channel * 2;
-
-	*val = (s16)((u16)ccxt->data_buffer[data_index] |
-			(u16)ccxt->data_buffer[data_index + 1] << 8);
+	*val = ccxt_proto_rpm(ccxt->data_buffer, channel);
 
 	hid_notice(ccxt->hdev, "fan%d rpm changed to %ld\n", channel, *val);
 
@@ -384,33 +517,28 @@ static int get_fan_rpm(struct ccxt_device *ccxt, int channel, long *val)
 
 static int get_fan_pwm(struct ccxt_device *ccxt, int channel, long *val)
 {
-	int ret, num_fans, data_index, id, pwm;
+	int ret, num_fans, pwm;
 
 	ret = read_data(ccxt, endpoint_fan_pwm);
 	if (ret)
 		return ret;
 
-	num_fans = ccxt->data_buffer[FAN_CNT_INDEX];
+	num_fans = ccxt_proto_fan_count(ccxt->data_buffer);
 
 	if (channel >= min(num_fans, NUM_FANS)) {
 		hid_notice(ccxt->hdev, "invalid fan channel %d\n", channel);
 		return -EINVAL;
 	}
 
-	data_index = FAN_DATA_OFFSET + channel * 4;
-
-	/* validate channel id from response */
-	id = ccxt->data_buffer[data_index];
-	if (id != channel) {
+	/* validates the channel id of the response */
+	pwm = ccxt_proto_pwm(ccxt->data_buffer, channel);
+	if (pwm < 0) {
 		hid_notice(ccxt->hdev,
-			"invalid fan id %d in response for channel %d\n", id,
-			channel);
-		return -EIO;
+			"invalid fan id in response for channel %d\n", channel);
+		return pwm;
 	}
 
-	pwm = ccxt->data_buffer[data_index + 2];
-
-	*val = DIV_ROUND_CLOSEST(pwm * 255, 100);
+	*val = pwm;
 
 	hid_notice(ccxt->hdev, "fan%d pwm changed to %ld\n", channel, *val);
 
@@ -419,6 +547,9 @@ static int get_fan_pwm(struct ccxt_device *ccxt, int channel, long *val)
 
 static int set_pwm(struct ccxt_device *ccxt, int channel, long val)
 {
+	u8 speed_cmd[1 + NUM_FANS * FAN_PWM_DATA_SIZE];
+	u8 duty[NUM_FANS];
+	size_t size;
 	int ret;
 
 	if (val < 0 || val > 255)
@@ -427,11 +558,11 @@ static int set_pwm(struct ccxt_device *ccxt, int channel, long val)
 	/* Corsair uses values from 0-100 */
 	val = DIV_ROUND_CLOSEST(val * 100, 255);
 
-	/* {count, id, mode, val, 0x00} */
-	const u8 speed_cmd[5] = { 1, channel, 0, val, 0x00 };
+	duty[channel] = val;
+	size = ccxt_proto_encode_pwm(speed_cmd, duty, 1UL << channel,
+				     NUM_FANS);
 	ret = write_data(ccxt, endpoint_fan_pwm, data_type_set_speed,
-			sizeof(data_type_set_speed), speed_cmd,
-			sizeof(speed_cmd));
+			sizeof(data_type_set_speed), speed_cmd, size);
 	if (!ret)
 		ccxt->target[channel] = -ENODATA;
 
@@ -440,11 +571,563 @@ static int set_pwm(struct ccxt_device *ccxt, int channel, long val)
 	return ret;
 }
 
-int main(void)
+/* pwm payload written by the write benchmarks, built from the current duty */
+static u8 bench_speed_cmd[1 + NUM_FANS * FAN_PWM_DATA_SIZE];
+static size_t bench_speed_cmd_size;
+
+static const u8 sweep_endpoints[] = {
+	endpoint_fan_state,
+	endpoint_fan_pwm,
+	endpoint_get_temperatures,
+};
+
+static int bench_read_sequence(struct ccxt_device *ccxt, const u8 *endpoint)
+{
+	return read_data(ccxt, *endpoint);
+}
+
+static int bench_read_session(struct ccxt_device *ccxt, const u8 *endpoint)
+{
+	return read_session(ccxt, *endpoint);
+}
+
+static int bench_sweep_sequence(struct ccxt_device *ccxt, const u8 *unused)
+{
+	int ret, i;
+
+	for (i = 0; i < ARRAY_SIZE(sweep_endpoints); i++) {
+		ret = read_data(ccxt, sweep_endpoints[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int bench_sweep_session(struct ccxt_device *ccxt, const u8 *unused)
+{
+	int ret, i;
+
+	for (i = 0; i < ARRAY_SIZE(sweep_endpoints); i++) {
+		ret = read_session(ccxt, sweep_endpoints[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int bench_write_sequence(struct ccxt_device *ccxt, const u8 *unused)
+{
+	return write_data(ccxt, endpoint_fan_pwm, data_type_set_speed,
+			sizeof(data_type_set_speed), bench_speed_cmd,
+			bench_speed_cmd_size);
+}
+
+static int bench_write_session(struct ccxt_device *ccxt, const u8 *unused)
+{
+	return write_session(ccxt, endpoint_fan_pwm, data_type_set_speed,
+			sizeof(data_type_set_speed), bench_speed_cmd,
+			bench_speed_cmd_size);
+}
+
+struct bench_case {
+	const char *name;
+	int (*run)(struct ccxt_device *ccxt, const u8 *arg);
+	const u8 *arg;
+	int write; /* changes device state, only run with -w */
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "fan_state/sequence", bench_read_sequence, &endpoint_fan_state },
+	{ "fan_state/session", bench_read_session, &endpoint_fan_state },
+	{ "fan_pwm/sequence", bench_read_sequence, &endpoint_fan_pwm },
+	{ "fan_pwm/session", bench_read_session, &endpoint_fan_pwm },
+	{ "get_fans/sequence", bench_read_sequence, &endpoint_get_fans },
+	{ "get_fans/session", bench_read_session, &endpoint_get_fans },
+	{ "temps/sequence", bench_read_sequence, &endpoint_get_temperatures },
+	{ "temps/session", bench_read_session, &endpoint_get_temperatures },
+	{ "sweep/sequence", bench_sweep_sequence, NULL },
+	{ "sweep/session", bench_sweep_session, NULL },
+	{ "pwm_write/sequence", bench_write_sequence, NULL, 1 },
+	{ "pwm_write/session", bench_write_session, NULL, 1 },
+};
+
+static int cmp_latency(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted log, in microseconds */
+static double percentile_us(const struct latency_log *log, int pct)
+{
+	size_t rank;
+
+	if (!log->len)
+		return 0;
+
+	rank = (log->len * pct + 99) / 100;
+	if (rank)
+		rank--;
+
+	return log->ns[rank] / 1000.0;
+}
+
+static void print_latency(const char *name, struct latency_log *log,
+			  double ops_per_s, double cmds_per_op)
+{
+	qsort(log->ns, log->len, sizeof(*log->ns), cmp_latency);
+
+	fprintf(stdout, "%-20s %6zu %9.1f %9.1f %9.1f %9.1f %9.1f %7.2f\n",
+		name, log->len, ops_per_s, percentile_us(log, 50),
+		percentile_us(log, 95), percentile_us(log, 99),
+		log->len ? log->ns[log->len - 1] / 1000.0 : 0, cmds_per_op);
+}
+
+/* build a pwm payload that writes the current duty of every fan back */
+static int bench_prepare_write(struct ccxt_device *ccxt)
+{
+	int ret, num_fans, channel, pwm;
+	u8 duty[NUM_FANS];
+
+	ret = read_data(ccxt, endpoint_fan_pwm);
+	if (ret)
+		return ret;
+
+	num_fans = min(ccxt_proto_fan_count(ccxt->data_buffer), NUM_FANS);
+
+	for (channel = 0; channel < num_fans; channel++) {
+		pwm = ccxt_proto_pwm(ccxt->data_buffer, channel);
+		if (pwm < 0)
+			return pwm;
+
+		/* exact inverse of the conversion to 0-255 */
+		duty[channel] = DIV_ROUND_CLOSEST(pwm * 100, 255);
+	}
+
+	bench_speed_cmd_size = ccxt_proto_encode_pwm(bench_speed_cmd, duty,
+						     (1UL << num_fans) - 1,
+						     num_fans);
+
+	return bench_speed_cmd[0] ? 0 : -ENODEV;
+}
+
+/*
+ * Run every benchmark case for the given number of iterations and print
+ * the latency of a whole operation, followed by the latency of every
+ * single send_usb over all cases.
+ */
+static int run_bench(struct ccxt_device *ccxt, int iterations, int writes)
+{
+	/* read_data and write_data use four commands per endpoint */
+	size_t cmd_cap = (size_t)iterations * ARRAY_SIZE(sweep_endpoints) * 4;
+	struct latency_log op_log = { 0 }, cmd_log = { 0 }, all_log = { 0 };
+	const struct bench_case *bc;
+	long long start, op_start, elapsed;
+	int ret = 0, i, n;
+
+	op_log.ns = calloc(iterations, sizeof(*op_log.ns));
+	op_log.cap = iterations;
+	cmd_log.ns = calloc(cmd_cap, sizeof(*cmd_log.ns));
+	cmd_log.cap = cmd_cap;
+	all_log.ns = calloc(cmd_cap * ARRAY_SIZE(bench_cases),
+			    sizeof(*all_log.ns));
+	all_log.cap = cmd_cap * ARRAY_SIZE(bench_cases);
+	if (!op_log.ns || !cmd_log.ns || !all_log.ns) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (writes) {
+		ret = bench_prepare_write(ccxt);
+		if (ret) {
+			fprintf(stderr, "Could not read current fan pwm: %d\n",
+				ret);
+			goto out_free;
+		}
+	}
+
+	fprintf(stdout, "%-20s %6s %9s %9s %9s %9s %9s %7s\n", "case", "ops",
+		"ops/s", "p50_us", "p95_us", "p99_us", "max_us", "cmds/op");
+
+	for (bc = bench_cases; bc < bench_cases + ARRAY_SIZE(bench_cases);
+	     bc++) {
+		if (bc->write && !writes)
+			continue;
+
+		op_log.len = 0;
+		cmd_log.len = 0;
+		ccxt->cmd_log = &cmd_log;
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			op_start = now_ns();
+			ret = bc->run(ccxt, bc->arg);
+			if (ret)
+				break;
+			log_latency(&op_log, now_ns() - op_start);
+		}
+		/* the session cost of the last close belongs to the case */
+		if (close_session(ccxt) && !ret)
+			ret = -EIO;
+		elapsed = now_ns() - start;
+
+		ccxt->cmd_log = NULL;
+
+		if (ret) {
+			fprintf(stderr, "%s failed after %d ops: %d\n",
+				bc->name, n, ret);
+			goto out_free;
+		}
+
+		print_latency(bc->name, &op_log, n * 1e9 / elapsed,
+			      (double)cmd_log.len / n);
+
+		for (i = 0; i < cmd_log.len; i++)
+			log_latency(&all_log, cmd_log.ns[i]);
+	}
+
+	print_latency("send_usb", &all_log, 0, 1);
+
+out_free:
+	ccxt->cmd_log = NULL;
+	free(all_log.ns);
+	free(cmd_log.ns);
+	free(op_log.ns);
+	return ret;
+}
+
+/*
+ * The record file starts with this header, followed by capacity slots
+ * of struct ccxt_sample. Record n lives in slot n % capacity, so the
+ * file never grows and always holds the newest records.
+ */
+struct record_header {
+	char magic[8]; /* RECORD_MAGIC */
+	u32 version; /* RECORD_VERSION */
+	u32 record_size; /* sizeof(struct ccxt_sample) */
+	u64 capacity; /* number of record slots */
+	u64 head; /* number of records written so far */
+	s64 realtime_offset_ns; /* CLOCK_REALTIME - CLOCK_MONOTONIC of the last capture */
+	u8 reserved[24];
+};
+
+static volatile sig_atomic_t record_stop;
+
+static void record_signal(int sig)
+{
+	record_stop = 1;
+}
+
+static void decode_fan_state(struct ccxt_device *ccxt,
+			     struct ccxt_sample *sample)
+{
+	int channel;
+
+	sample->num_fans = min(ccxt_proto_fan_count(ccxt->data_buffer),
+			       NUM_FANS);
+
+	for (channel = 0; channel < sample->num_fans; channel++)
+		sample->rpm[channel] = ccxt_proto_rpm(ccxt->data_buffer,
+						      channel);
+
+	sample->valid |= CCXT_SAMPLE_VALID_RPM;
+}
+
+static int decode_fan_pwm(struct ccxt_device *ccxt, struct ccxt_sample *sample)
+{
+	int num_fans, channel, pwm;
+
+	num_fans = min(ccxt_proto_fan_count(ccxt->data_buffer), NUM_FANS);
+
+	for (channel = 0; channel < num_fans; channel++) {
+		pwm = ccxt_proto_pwm(ccxt->data_buffer, channel);
+		if (pwm < 0)
+			return pwm;
+
+		sample->pwm[channel] = pwm;
+	}
+
+	sample->valid |= CCXT_SAMPLE_VALID_PWM;
+	return 0;
+}
+
+static void decode_temperatures(struct ccxt_device *ccxt,
+				struct ccxt_sample *sample)
+{
+	int channel;
+	long val;
+
+	sample->num_temp_sensors = min(ccxt_proto_temp_count(ccxt->data_buffer),
+				       NUM_TEMP_SENSORS);
+	sample->temp_cnct = 0;
+
+	for (channel = 0; channel < sample->num_temp_sensors; channel++) {
+		if (ccxt_proto_temp(ccxt->data_buffer, channel, &val))
+			continue;
+
+		sample->temp_cnct |= 1 << channel;
+		sample->temp[channel] = val;
+	}
+
+	sample->valid |= CCXT_SAMPLE_VALID_TEMP;
+}
+
+/*
+ * Read one sample over a persistent session. Endpoints that time out are
+ * left out of sample->valid, any other error aborts the recording.
+ */
+static int record_sample(struct ccxt_device *ccxt, struct ccxt_sample *sample)
+{
+	int ret;
+
+	memset(sample, 0, sizeof(*sample));
+	sample->version = CCXT_SAMPLE_VERSION;
+	sample->size = sizeof(*sample);
+	sample->fan_cnct = ccxt->fan_cnct[0];
+
+	ret = read_session(ccxt, endpoint_fan_state);
+	if (!ret)
+		decode_fan_state(ccxt, sample);
+	else if (ret != -ETIMEDOUT)
+		return ret;
+
+	ret = read_session(ccxt, endpoint_fan_pwm);
+	if (!ret)
+		decode_fan_pwm(ccxt, sample);
+	else if (ret != -ETIMEDOUT)
+		return ret;
+
+	ret = read_session(ccxt, endpoint_get_temperatures);
+	if (!ret)
+		decode_temperatures(ccxt, sample);
+	else if (ret != -ETIMEDOUT)
+		return ret;
+
+	sample->timestamp_ns = now_ns();
+	return 0;
+}
+
+/*
+ * Map the ring file, creating it if needed. An existing file is appended
+ * to if its layout matches, so a capture can be resumed.
+ */
+static struct record_header *record_map(const char *path, u64 capacity,
+					int create, size_t *map_size)
+{
+	struct record_header *hdr;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st))
+		goto out_perror;
+
+	if (!create || st.st_size) {
+		struct record_header cur;
+
+		if (pread(fd, &cur, sizeof(cur), 0) != sizeof(cur) ||
+		    memcmp(cur.magic, RECORD_MAGIC, sizeof(cur.magic)) ||
+		    cur.version != RECORD_VERSION ||
+		    cur.record_size != sizeof(struct ccxt_sample) ||
+		    (create && cur.capacity != capacity)) {
+			fprintf(stderr, "%s: not a matching record file\n",
+				path);
+			goto out_close;
+		}
+		capacity = cur.capacity;
+	}
+
+	size = sizeof(*hdr) + capacity * sizeof(struct ccxt_sample);
+	if (create && ftruncate(fd, size))
+		goto out_perror;
+	if (!create && st.st_size < size) {
+		fprintf(stderr, "%s: truncated record file\n", path);
+		goto out_close;
+	}
+
+	hdr = mmap(NULL, size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out_perror;
+	close(fd);
+
+	if (create && !st.st_size) {
+		memcpy(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic));
+		hdr->version = RECORD_VERSION;
+		hdr->record_size = sizeof(struct ccxt_sample);
+		hdr->capacity = capacity;
+		hdr->head = 0;
+	}
+
+	*map_size = size;
+	return hdr;
+
+out_perror:
+	perror(path);
+out_close:
+	close(fd);
+	return NULL;
+}
+
+static int run_record(struct ccxt_device *ccxt, const char *path,
+		      u64 capacity, int duration_s, int interval_ms)
+{
+	struct ccxt_sample *slots, sample;
+	struct record_header *hdr;
+	struct timespec rt;
+	long long end = 0, next;
+	size_t map_size;
+	u64 head, start_head;
+	int ret;
+
+	ret = get_fan_cnct(ccxt);
+	if (ret) {
+		fprintf(stderr, "Could not read connected fans: %d\n", ret);
+		return ret;
+	}
+
+	hdr = record_map(path, capacity, 1, &map_size);
+	if (!hdr)
+		return -EIO;
+	slots = (struct ccxt_sample *)(hdr + 1);
+
+	clock_gettime(CLOCK_REALTIME, &rt);
+	hdr->realtime_offset_ns = (long long)rt.tv_sec * 1000000000LL +
+				  rt.tv_nsec - now_ns();
+
+	signal(SIGINT, record_signal);
+	signal(SIGTERM, record_signal);
+
+	head = start_head = hdr->head;
+	next = now_ns();
+	if (duration_s)
+		end = next + duration_s * 1000000000LL;
+
+	while (!record_stop && (!end || now_ns() < end)) {
+		ret = record_sample(ccxt, &sample);
+		if (ret) {
+			fprintf(stderr, "Recording failed: %d\n", ret);
+			break;
+		}
+
+		sample.seq = head;
+		slots[head % hdr->capacity] = sample;
+		/* publish the slot before a reader can see the new head */
+		__atomic_store_n(&hdr->head, ++head, __ATOMIC_RELEASE);
+
+		if (interval_ms) {
+			struct timespec ts;
+
+			next += interval_ms * 1000000LL;
+			ts.tv_sec = next / 1000000000LL;
+			ts.tv_nsec = next % 1000000000LL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+	}
+
+	close_session(ccxt);
+	msync(hdr, map_size, MS_SYNC);
+	munmap(hdr, map_size);
+
+	fprintf(stdout, "%llu records written to %s\n",
+		(unsigned long long)(head - start_head), path);
+
+	return ret;
+}
+
+/* print the records of a ring file as CSV, oldest first */
+static int run_decode(const char *path)
+{
+	const struct ccxt_sample *slots, *sample;
+	struct record_header *hdr;
+	size_t map_size;
+	u64 head, n;
+	int i;
+
+	hdr = record_map(path, 0, 0, &map_size);
+	if (!hdr)
+		return -EIO;
+	slots = (const struct ccxt_sample *)(hdr + 1);
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	fprintf(stdout, "seq,realtime_ns,monotonic_ns,valid");
+	for (i = 0; i < CCXT_SAMPLE_FANS; i++)
+		fprintf(stdout, ",fan%d_rpm", i + 1);
+	for (i = 0; i < CCXT_SAMPLE_FANS; i++)
+		fprintf(stdout, ",fan%d_pwm", i + 1);
+	for (i = 0; i < CCXT_SAMPLE_TEMP_SENSORS; i++)
+		fprintf(stdout, ",temp%d", i + 1);
+	fprintf(stdout, "\n");
+
+	for (n = head > hdr->capacity ? head - hdr->capacity : 0; n < head;
+	     n++) {
+		sample = &slots[n % hdr->capacity];
+
+		fprintf(stdout, "%llu,%lld,%llu,%u",
+			(unsigned long long)sample->seq,
+			(long long)(sample->timestamp_ns +
+				    hdr->realtime_offset_ns),
+			(unsigned long long)sample->timestamp_ns,
+			sample->valid);
+		for (i = 0; i < CCXT_SAMPLE_FANS; i++)
+			fprintf(stdout, ",%d", sample->rpm[i]);
+		for (i = 0; i < CCXT_SAMPLE_FANS; i++)
+			fprintf(stdout, ",%d", sample->pwm[i]);
+		for (i = 0; i < CCXT_SAMPLE_TEMP_SENSORS; i++) {
+			if (sample->temp_cnct & (1 << i))
+				fprintf(stdout, ",%d", sample->temp[i]);
+			else
+				fprintf(stdout, ",");
+		}
+		fprintf(stdout, "\n");
+	}
+
+	munmap(hdr, map_size);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [info|bench|record|decode]\n"
+		"  info         print the firmware and dump the temperature endpoint (default)\n"
+		"  bench        time every endpoint read and the full sweep\n"
+		"  record       append samples to a ring file until interrupted\n"
+		"  decode       print the samples of a ring file as CSV\n"
+		"  -n N         iterations per benchmark case (default %d)\n"
+		"  -w           also benchmark pwm writes (writes back the current duty)\n"
+		"  -o FILE      ring file for record and decode (default ccxt.rec)\n"
+		"  -c N         record slots of a new ring file (default %d)\n"
+		"  -t SECONDS   stop recording after SECONDS\n"
+		"  -i MS        sample every MS milliseconds instead of back to back\n"
+		"  -m US        use a simulated controller answering after US microseconds\n",
+		prog, BENCH_ITERATIONS, RECORD_CAPACITY);
+}
+
+int main(int argc, char **argv)
 {
 	u8 cmd_buffer[OUT_BUFFER_SIZE];
 	u8 buffer[IN_BUFFER_SIZE];
 	u8 data_buffer[IN_BUFFER_SIZE];
+	int iterations = BENCH_ITERATIONS, writes = 0, opt;
+	int duration_s = 0, interval_ms = 0;
+	long long capacity = RECORD_CAPACITY;
+	const char *path = "ccxt.rec";
+	const char *mode = "info";
+	struct ccxt_mock mock = {
+		.open_endpoint = ENDPOINT_NONE,
+		.duty = { 40, 40, 40, 40, 40, 40 },
+	};
 
 	struct ccxt_device ccxt = {
 		.cmd_buffer = cmd_buffer,
@@ -452,19 +1135,77 @@ int main(void)
 		.data_buffer = data_buffer,
 	};
 
-	int res = hid_init();
-	if (res) {
-		fprintf(stderr, "Could not initialize hid_api\n");
-		return 1;
+	ccxt_proto_session_init(&ccxt.session, &transport, &ccxt, cmd_buffer);
+
+	while ((opt = getopt(argc, argv, "n:wo:c:t:i:m:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		case 'c':
+			capacity = atoll(optarg);
+			if (capacity <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			duration_s = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'm':
+			mock.latency_ns = atoll(optarg) * 1000;
+			ccxt.mock = &mock;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
 	}
 
-	ccxt.hdev = hid_open(USB_VENDOR_ID_CORSAIR,
-				USB_PRODUCT_ID_CORSAIR_COMMANDER_CORE_XT, NULL);
-	if (ccxt.hdev == NULL) {
-		fprintf(stderr, "Could not find device\n");
+	if (optind < argc)
+		mode = argv[optind];
+
+	if (strcmp(mode, "info") && strcmp(mode, "bench") &&
+	    strcmp(mode, "record") && strcmp(mode, "decode")) {
+		usage(argv[0]);
 		return 1;
 	}
 
+	/* decoding works on the file only */
+	if (!strcmp(mode, "decode"))
+		return run_decode(path) ? 1 : 0;
+
+	int res = 0;
+
+	if (!ccxt.mock) {
+		res = hid_init();
+		if (res) {
+			fprintf(stderr, "Could not initialize hid_api\n");
+			return 1;
+		}
+
+		ccxt.hdev = hid_open(USB_VENDOR_ID_CORSAIR,
+				     USB_PRODUCT_ID_CORSAIR_COMMANDER_CORE_XT,
+				     NULL);
+		if (ccxt.hdev == NULL) {
+			fprintf(stderr, "Could not find device\n");
+			return 1;
+		}
+	}
+
 	res = get_fw_version(&ccxt);
 	if (res)
 		goto close;
@@ -476,6 +1217,17 @@ int main(void)
 	if (res)
 		goto close;
 
+	if (!strcmp(mode, "bench")) {
+		res = run_bench(&ccxt, iterations, writes);
+		goto close;
+	}
+
+	if (!strcmp(mode, "record")) {
+		res = run_record(&ccxt, path, capacity, duration_s,
+				 interval_ms);
+		goto close;
+	}
+
 	res = get_temp_cnct(&ccxt);
 	print_buffer(ccxt.data_buffer, ccxt.data_buffer_recv_size);
 
@@ -484,7 +1236,10 @@ int main(void)
 		goto close;*/
 
 close:
-	hid_close(ccxt.hdev);
+	if (ccxt.hdev) {
+		hid_close(ccxt.hdev);
+		hid_exit();
+	}
 
-	return 0;
-}
\ No newline at end of file
+	return strcmp(mode, "info") && res ? 1 : 0;
+}